@@ -0,0 +1,239 @@
+#include "bitter.h"
+#include "bench.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+
+// Count every allocation in the process, including those made by wlroots
+// and the renderer, by wrapping glibc's allocator.
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+
+static _Atomic uint64_t allocations;
+
+void *malloc(size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+typedef struct Bench {
+    Server *srv;
+    const char *exe;
+    int clients;
+    int rate;
+    int duration;
+    pid_t *pids;
+    int *fds;
+    uint64_t start_allocations, end_allocations;
+    uint64_t start_frames, end_frames;
+    uint64_t start_upload, end_upload;
+    int64_t start_usec, end_usec;
+    struct wl_event_source *start_timer;
+    struct wl_event_source *stop_timer;
+} Bench;
+
+static uint64_t bench_frames(Server *srv) {
+    uint64_t frames = 0;
+    Output *out;
+    wl_list_for_each (out, &srv->outputs, link) {
+        frames += out->stats.frames;
+    }
+    return frames;
+}
+
+// Runs once the event loop is up, so WAYLAND_DISPLAY is already set.
+static int bench_start(void *data) {
+    Bench *b = data;
+    char rate[16], duration[16], fd[16];
+    snprintf(rate, sizeof(rate), "%d", b->rate);
+    snprintf(duration, sizeof(duration), "%d", b->duration);
+    for (int i = 0; i < b->clients; i++) {
+        int pipefd[2];
+        if (pipe(pipefd) < 0) {
+            b->fds[i] = -1;
+            continue;
+        }
+        pid_t pid = fork();
+        if (pid == 0) {
+            close(pipefd[0]);
+            snprintf(fd, sizeof(fd), "%d", pipefd[1]);
+            execl(b->exe, b->exe, "--client", rate, duration, fd, NULL);
+            _exit(127);
+        }
+        close(pipefd[1]);
+        b->pids[i] = pid;
+        b->fds[i] = pid > 0 ? pipefd[0] : -1;
+    }
+    b->start_allocations = atomic_load(&allocations);
+    b->start_frames = bench_frames(b->srv);
+    b->start_upload = b->srv->upload_bytes;
+    b->start_usec = now_usec();
+    // leave the clients a moment to hang up before stopping
+    wl_event_source_timer_update(b->stop_timer, b->duration * 1000 + 500);
+    return 0;
+}
+
+static int bench_stop(void *data) {
+    Bench *b = data;
+    b->end_allocations = atomic_load(&allocations);
+    b->end_frames = bench_frames(b->srv);
+    b->end_upload = b->srv->upload_bytes;
+    b->end_usec = now_usec();
+    wl_display_terminate(b->srv->display);
+    return 0;
+}
+
+static bool read_result(int fd, BenchResult *result) {
+    size_t size = 0;
+    for (;;) {
+        ssize_t n = read(fd, (char *)result + size, sizeof(*result) - size);
+        if (n <= 0)
+            break;
+        size += n;
+    }
+    close(fd);
+    return size >= offsetof(BenchResult, latency_usec)
+        && size == offsetof(BenchResult, latency_usec)
+            + result->samples * sizeof(result->latency_usec[0]);
+}
+
+static int compare_u32(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+static uint32_t sorted_percentile(uint32_t *values, size_t len,
+    double fraction)
+{
+    if (len == 0)
+        return 0;
+    size_t i = len * fraction;
+    return values[i < len ? i : len - 1];
+}
+
+static int bench_report(Bench *b) {
+    int failed = 0;
+    uint64_t commits = 0;
+    size_t len = 0;
+    uint32_t *latencies = malloc(
+        sizeof(uint32_t) * BENCH_MAX_SAMPLES * b->clients);
+    static BenchResult result;
+    for (int i = 0; i < b->clients; i++) {
+        int status = 0;
+        bool ok = b->fds[i] >= 0 && read_result(b->fds[i], &result);
+        if (b->fds[i] >= 0)
+            waitpid(b->pids[i], &status, 0);
+        if (!ok || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed++;
+            continue;
+        }
+        commits += result.commits;
+        memcpy(&latencies[len], result.latency_usec,
+            result.samples * sizeof(uint32_t));
+        len += result.samples;
+    }
+    qsort(latencies, len, sizeof(uint32_t), compare_u32);
+
+    static Histogram render;
+    Output *out;
+    wl_list_for_each (out, &b->srv->outputs, link) {
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++)
+            render.counts[i] += out->stats.render.counts[i];
+        render.total += out->stats.render.total;
+        if (out->stats.render.max > render.max)
+            render.max = out->stats.render.max;
+    }
+
+    double seconds = (b->end_usec - b->start_usec) / 1e6;
+    uint64_t frames = b->end_frames - b->start_frames;
+    uint64_t allocs = b->end_allocations - b->start_allocations;
+    printf("clients: %d (%d failed), rate: %d Hz, duration: %d s\n",
+        b->clients, failed, b->rate, b->duration);
+    printf("frames/sec: %.1f\n", frames / seconds);
+    printf("commits/sec: %.1f\n", commits / seconds);
+    printf("frame time us: p50 %u p99 %u max %u\n",
+        histogram_percentile(&render, 0.5),
+        histogram_percentile(&render, 0.99), render.max);
+    printf("commit to frame done us: p50 %u p99 %u\n",
+        sorted_percentile(latencies, len, 0.5),
+        sorted_percentile(latencies, len, 0.99));
+    printf("rss: %ld KiB\n", account_rss_kib());
+    printf("allocations/frame: %.1f\n",
+        frames > 0 ? (double)allocs / frames : 0.0);
+    printf("uploaded KiB/frame: %.1f\n", frames > 0
+        ? (b->end_upload - b->start_upload) / 1024.0 / frames : 0.0);
+    free(latencies);
+    return failed == 0 && frames > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+static void usage(const char *argv0) {
+    fprintf(stderr, "usage: %s [-c clients] [-r commits/sec] [-d seconds]\n",
+        argv0);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc == 5 && strcmp(argv[1], "--client") == 0)
+        return bench_client_main(atoi(argv[2]), atoi(argv[3]), atoi(argv[4]));
+
+    Bench b = {
+        .exe = "/proc/self/exe",
+        .clients = 8,
+        .rate = 60,
+        .duration = 5,
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "c:r:d:h")) != -1) {
+        switch (opt) {
+            case 'c': b.clients = atoi(optarg); break;
+            case 'r': b.rate = atoi(optarg); break;
+            case 'd': b.duration = atoi(optarg); break;
+            default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (b.clients < 1 || b.rate < 1 || b.duration < 1) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // no GPU needed; these are no-ops if the caller already chose
+    setenv("WLR_BACKENDS", "headless", false);
+    setenv("WLR_RENDERER_ALLOW_SOFTWARE", "1", false);
+    setenv("LIBGL_ALWAYS_SOFTWARE", "1", false);
+    // all but one client are unfocused; measure them at the rate they ask
+    setenv("BITTER_UNFOCUSED_HZ", "0", false);
+    wlr_log_init(WLR_ERROR, NULL);
+
+    b.srv = server_create();
+    b.pids = calloc(b.clients, sizeof(pid_t));
+    b.fds = calloc(b.clients, sizeof(int));
+    struct wl_event_loop *loop = wl_display_get_event_loop(b.srv->display);
+    b.start_timer = wl_event_loop_add_timer(loop, bench_start, &b);
+    b.stop_timer = wl_event_loop_add_timer(loop, bench_stop, &b);
+    wl_event_source_timer_update(b.start_timer, 1);
+    if (!server_run(b.srv)) {
+        fprintf(stderr, "failed to start the server\n");
+        return EXIT_FAILURE;
+    }
+
+    int ret = bench_report(&b);
+    wl_event_source_remove(b.start_timer);
+    wl_event_source_remove(b.stop_timer);
+    server_destroy(b.srv);
+    free(b.pids);
+    free(b.fds);
+    return ret;
+}
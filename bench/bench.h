@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BENCH_MAX_SAMPLES 8192
+
+// What each synthetic client reports back through its pipe. Only the
+// first `samples` latencies are sent.
+typedef struct BenchResult {
+    uint32_t commits;
+    uint32_t samples;
+    uint32_t latency_usec[BENCH_MAX_SAMPLES]; // commit to frame done
+} BenchResult;
+
+int bench_client_main(int rate, int duration, int fd);
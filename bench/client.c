@@ -0,0 +1,295 @@
+#include "bench.h"
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-client.h>
+#include "xdg-shell-client-protocol.h"
+
+#define CLIENT_BUFFERS 2
+#define CLIENT_DEFAULT_SIZE 256
+
+typedef struct ClientBuffer {
+    struct wl_buffer *buffer;
+    uint32_t *data;
+    bool busy;
+} ClientBuffer;
+
+typedef struct Client {
+    struct wl_display *display;
+    struct wl_compositor *compositor;
+    struct wl_shm *shm;
+    struct xdg_wm_base *wm_base;
+    struct wl_surface *surface;
+    struct xdg_surface *xdg_surface;
+    struct xdg_toplevel *toplevel;
+    ClientBuffer buffers[CLIENT_BUFFERS];
+    void *pool_data;
+    size_t pool_size;
+    int width, height;
+    int pending_width, pending_height;
+    bool configured;
+    bool frame_pending;
+    bool closed;
+    struct timespec committed;
+    uint32_t color;
+    BenchResult result;
+} Client;
+
+static int64_t now_usec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void buffer_release(void *data, struct wl_buffer *buffer) {
+    ClientBuffer *buf = data;
+    buf->busy = false;
+}
+
+static const struct wl_buffer_listener buffer_listener = {
+    .release = buffer_release,
+};
+
+static void client_destroy_buffers(Client *c) {
+    for (int i = 0; i < CLIENT_BUFFERS; i++) {
+        if (c->buffers[i].buffer)
+            wl_buffer_destroy(c->buffers[i].buffer);
+        c->buffers[i] = (ClientBuffer) {0};
+    }
+    if (c->pool_data)
+        munmap(c->pool_data, c->pool_size);
+    c->pool_data = NULL;
+}
+
+static bool client_create_buffers(Client *c, int width, int height) {
+    client_destroy_buffers(c);
+    int stride = width * 4;
+    size_t size = (size_t)stride * height;
+    c->pool_size = size * CLIENT_BUFFERS;
+
+    char name[64];
+    snprintf(name, sizeof(name), "/bitter-bench-%d", getpid());
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return false;
+    shm_unlink(name);
+    if (ftruncate(fd, c->pool_size) < 0) {
+        close(fd);
+        return false;
+    }
+    c->pool_data = mmap(NULL, c->pool_size, PROT_READ | PROT_WRITE,
+        MAP_SHARED, fd, 0);
+    if (c->pool_data == MAP_FAILED) {
+        c->pool_data = NULL;
+        close(fd);
+        return false;
+    }
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(c->shm, fd, c->pool_size);
+    for (int i = 0; i < CLIENT_BUFFERS; i++) {
+        ClientBuffer *buf = &c->buffers[i];
+        buf->buffer = wl_shm_pool_create_buffer(pool, size * i,
+            width, height, stride, WL_SHM_FORMAT_XRGB8888);
+        buf->data = (uint32_t *)((char *)c->pool_data + size * i);
+        wl_buffer_add_listener(buf->buffer, &buffer_listener, buf);
+    }
+    wl_shm_pool_destroy(pool);
+    close(fd);
+    c->width = width;
+    c->height = height;
+    return true;
+}
+
+static void frame_done(void *data, struct wl_callback *callback,
+    uint32_t time)
+{
+    Client *c = data;
+    wl_callback_destroy(callback);
+    c->frame_pending = false;
+    int64_t committed = (int64_t)c->committed.tv_sec * 1000000
+        + c->committed.tv_nsec / 1000;
+    if (c->result.samples < BENCH_MAX_SAMPLES)
+        c->result.latency_usec[c->result.samples++] = now_usec() - committed;
+}
+
+static const struct wl_callback_listener frame_listener = {
+    .done = frame_done,
+};
+
+static void client_draw(Client *c) {
+    ClientBuffer *buf = NULL;
+    for (int i = 0; i < CLIENT_BUFFERS; i++) {
+        if (!c->buffers[i].busy) {
+            buf = &c->buffers[i];
+            break;
+        }
+    }
+    if (!buf)
+        return;
+
+    c->color += 0x010203;
+    size_t pixels = (size_t)c->width * c->height;
+    for (size_t i = 0; i < pixels; i++)
+        buf->data[i] = 0xff000000 | c->color;
+
+    wl_surface_attach(c->surface, buf->buffer, 0, 0);
+    wl_surface_damage_buffer(c->surface, 0, 0, c->width, c->height);
+    struct wl_callback *callback = wl_surface_frame(c->surface);
+    wl_callback_add_listener(callback, &frame_listener, c);
+    clock_gettime(CLOCK_MONOTONIC, &c->committed);
+    wl_surface_commit(c->surface);
+    buf->busy = true;
+    c->frame_pending = true;
+    c->result.commits++;
+}
+
+static void wm_base_ping(void *data, struct xdg_wm_base *wm_base,
+    uint32_t serial)
+{
+    xdg_wm_base_pong(wm_base, serial);
+}
+
+static const struct xdg_wm_base_listener wm_base_listener = {
+    .ping = wm_base_ping,
+};
+
+static void xdg_surface_configure(void *data, struct xdg_surface *surface,
+    uint32_t serial)
+{
+    Client *c = data;
+    xdg_surface_ack_configure(surface, serial);
+    int width = c->pending_width > 0 ? c->pending_width : CLIENT_DEFAULT_SIZE;
+    int height = c->pending_height > 0 ? c->pending_height : CLIENT_DEFAULT_SIZE;
+    if (width != c->width || height != c->height)
+        c->configured = client_create_buffers(c, width, height);
+}
+
+static const struct xdg_surface_listener xdg_surface_listener = {
+    .configure = xdg_surface_configure,
+};
+
+static void toplevel_configure(void *data, struct xdg_toplevel *toplevel,
+    int32_t width, int32_t height, struct wl_array *states)
+{
+    Client *c = data;
+    c->pending_width = width;
+    c->pending_height = height;
+}
+
+static void toplevel_close(void *data, struct xdg_toplevel *toplevel) {
+    Client *c = data;
+    c->closed = true;
+}
+
+static const struct xdg_toplevel_listener toplevel_listener = {
+    .configure = toplevel_configure,
+    .close = toplevel_close,
+};
+
+static void registry_global(void *data, struct wl_registry *registry,
+    uint32_t name, const char *interface, uint32_t version)
+{
+    Client *c = data;
+    if (strcmp(interface, wl_compositor_interface.name) == 0) {
+        c->compositor = wl_registry_bind(registry, name,
+            &wl_compositor_interface, 4);
+    } else if (strcmp(interface, wl_shm_interface.name) == 0) {
+        c->shm = wl_registry_bind(registry, name, &wl_shm_interface, 1);
+    } else if (strcmp(interface, xdg_wm_base_interface.name) == 0) {
+        c->wm_base = wl_registry_bind(registry, name,
+            &xdg_wm_base_interface, 1);
+        xdg_wm_base_add_listener(c->wm_base, &wm_base_listener, c);
+    }
+}
+
+static void registry_global_remove(void *data, struct wl_registry *registry,
+    uint32_t name)
+{
+}
+
+static const struct wl_registry_listener registry_listener = {
+    .global = registry_global,
+    .global_remove = registry_global_remove,
+};
+
+// Reads and dispatches events, waiting at most timeout milliseconds.
+static bool client_dispatch(Client *c, int timeout) {
+    while (wl_display_prepare_read(c->display) != 0) {
+        if (wl_display_dispatch_pending(c->display) < 0)
+            return false;
+    }
+    wl_display_flush(c->display);
+    struct pollfd pfd = {
+        .fd = wl_display_get_fd(c->display),
+        .events = POLLIN,
+    };
+    if (poll(&pfd, 1, timeout) > 0 && (pfd.revents & POLLIN)) {
+        if (wl_display_read_events(c->display) < 0)
+            return false;
+    } else {
+        wl_display_cancel_read(c->display);
+    }
+    return wl_display_dispatch_pending(c->display) >= 0;
+}
+
+int bench_client_main(int rate, int duration, int fd) {
+    static Client c;
+    c.display = wl_display_connect(NULL);
+    if (!c.display)
+        return EXIT_FAILURE;
+    struct wl_registry *registry = wl_display_get_registry(c.display);
+    wl_registry_add_listener(registry, &registry_listener, &c);
+    wl_display_roundtrip(c.display);
+    if (!c.compositor || !c.shm || !c.wm_base)
+        return EXIT_FAILURE;
+
+    c.surface = wl_compositor_create_surface(c.compositor);
+    c.xdg_surface = xdg_wm_base_get_xdg_surface(c.wm_base, c.surface);
+    xdg_surface_add_listener(c.xdg_surface, &xdg_surface_listener, &c);
+    c.toplevel = xdg_surface_get_toplevel(c.xdg_surface);
+    xdg_toplevel_add_listener(c.toplevel, &toplevel_listener, &c);
+    xdg_toplevel_set_title(c.toplevel, "bitter-bench");
+    wl_surface_commit(c.surface);
+
+    int64_t period = 1000000 / (rate > 0 ? rate : 1);
+    int64_t start = now_usec();
+    int64_t end = start + (int64_t)duration * 1000000;
+    int64_t next = start;
+    for (int64_t now = start; now < end && !c.closed; now = now_usec()) {
+        if (c.configured && !c.frame_pending && now >= next) {
+            client_draw(&c);
+            next += period;
+            if (next < now)
+                next = now;
+        }
+        int64_t wait = (c.frame_pending ? end : next) - now;
+        if (wait < 0)
+            wait = 0;
+        if (!client_dispatch(&c, wait / 1000 + 1))
+            break;
+    }
+
+    xdg_toplevel_destroy(c.toplevel);
+    xdg_surface_destroy(c.xdg_surface);
+    wl_surface_destroy(c.surface);
+    client_destroy_buffers(&c);
+    wl_display_disconnect(c.display);
+
+    size_t size = offsetof(BenchResult, latency_usec)
+        + c.result.samples * sizeof(c.result.latency_usec[0]);
+    const char *pos = (const char *)&c.result;
+    while (size > 0) {
+        ssize_t written = write(fd, pos, size);
+        if (written <= 0)
+            return EXIT_FAILURE;
+        pos += written;
+        size -= written;
+    }
+    close(fd);
+    return EXIT_SUCCESS;
+}
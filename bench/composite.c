@@ -0,0 +1,104 @@
+#include "bitter.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Times each set of compositing kernels this CPU supports over a whole
+// frame, checking along the way that they all agree with the scalar ones.
+
+#define FRAME_WIDTH 1920
+#define FRAME_HEIGHT 1080
+
+typedef void (*RowFunc)(uint32_t *dst, const uint32_t *src, int len);
+
+// Premultiplied pixels in runs of opaque, clear and translucent, like
+// windows with shadows and rounded corners.
+static void fill_source(uint32_t *src, size_t len) {
+    uint32_t seed = 1;
+    for (size_t i = 0; i < len; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint32_t run = (i / 64) % 3;
+        uint32_t a = run == 0 ? 255 : run == 1 ? 0 : seed >> 24;
+        uint32_t r = ((seed >> 16) & 0xff) * a / 255;
+        uint32_t g = ((seed >> 8) & 0xff) * a / 255;
+        uint32_t b = (seed & 0xff) * a / 255;
+        src[i] = a << 24 | r << 16 | g << 8 | b;
+    }
+}
+
+static void fill_background(uint32_t *dst, size_t len) {
+    for (size_t i = 0; i < len; i++)
+        dst[i] = 0xff000000 | (uint32_t)(i * 2654435761u >> 8);
+}
+
+// Rows are offset and shortened so unaligned starts and tails are covered.
+static void apply(RowFunc row, uint32_t *dst, const uint32_t *src) {
+    for (int y = 0; y < FRAME_HEIGHT; y++) {
+        size_t offset = (size_t)y * FRAME_WIDTH + 1;
+        row(dst + offset, src + offset, FRAME_WIDTH - 3);
+    }
+}
+
+static double mpixels_per_sec(RowFunc row, uint32_t *dst,
+    const uint32_t *src, int iterations)
+{
+    int64_t start = now_usec();
+    for (int i = 0; i < iterations; i++) {
+        for (int y = 0; y < FRAME_HEIGHT; y++) {
+            size_t offset = (size_t)y * FRAME_WIDTH;
+            row(dst + offset, src + offset, FRAME_WIDTH);
+        }
+    }
+    int64_t usec = now_usec() - start;
+    return usec > 0
+        ? (double)FRAME_WIDTH * FRAME_HEIGHT * iterations / usec : 0.0;
+}
+
+int main(int argc, char *argv[]) {
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    if (iterations < 1) {
+        fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t len = (size_t)FRAME_WIDTH * FRAME_HEIGHT;
+    uint32_t *src = malloc(len * sizeof(uint32_t));
+    uint32_t *dst = malloc(len * sizeof(uint32_t));
+    uint32_t *copied = malloc(len * sizeof(uint32_t));
+    uint32_t *blended = malloc(len * sizeof(uint32_t));
+    if (!src || !dst || !copied || !blended)
+        return EXIT_FAILURE;
+    fill_source(src, len);
+
+    const CompositeKernels *scalar =
+        &composite_kernels[composite_kernels_len - 1];
+    fill_background(copied, len);
+    apply(scalar->copy, copied, src);
+    fill_background(blended, len);
+    apply(scalar->blend, blended, src);
+
+    int failed = 0;
+    printf("%-8s %14s %14s\n", "kernels", "copy Mpx/s", "blend Mpx/s");
+    for (int i = 0; i < composite_kernels_len; i++) {
+        const CompositeKernels *k = &composite_kernels[i];
+        if (!composite_kernels_supported(k))
+            continue;
+        fill_background(dst, len);
+        apply(k->copy, dst, src);
+        bool ok = memcmp(dst, copied, len * sizeof(uint32_t)) == 0;
+        fill_background(dst, len);
+        apply(k->blend, dst, src);
+        ok = ok && memcmp(dst, blended, len * sizeof(uint32_t)) == 0;
+        if (!ok) {
+            fprintf(stderr, "%s: results differ from scalar\n", k->name);
+            failed++;
+        }
+        double copy = mpixels_per_sec(k->copy, dst, src, iterations);
+        double blend = mpixels_per_sec(k->blend, dst, src, iterations);
+        printf("%-8s %14.1f %14.1f\n", k->name, copy, blend);
+    }
+    free(src);
+    free(dst);
+    free(copied);
+    free(blended);
+    return failed == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,167 @@
+#include "bitter.h"
+#include <stdio.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+
+// Per-client counts and bytes of what bitter holds on each client's behalf.
+// Accounts are looked up through the client's destroy listener rather than
+// stored anywhere: libwayland drops the listener before destroying the
+// client's resources, so anything released during teardown finds no account
+// and is simply not counted.
+
+static const char *account_type_names[ACCOUNT_TYPES] = {
+    [AccountSurface] = "surfaces",
+    [AccountView] = "views",
+    [AccountPopup] = "popups",
+    [AccountTexture] = "textures",
+};
+
+// Beyond these a client is disconnected; nothing legitimate comes close.
+static const uint64_t account_max_count[ACCOUNT_TYPES] = {
+    [AccountSurface] = 4096,
+    [AccountView] = 512,
+    [AccountPopup] = 512,
+    [AccountTexture] = 4096,
+};
+
+static const uint64_t account_max_bytes[ACCOUNT_TYPES] = {
+    [AccountTexture] = (uint64_t)2 << 30,
+};
+
+void client_account_destroy(ClientAccount *account, void *data) {
+    wl_list_remove(&account->on_destroy.link);
+    wl_list_remove(&account->link);
+    pool_free(&client_account_pool, account);
+}
+
+static ClientAccount *account_find(struct wl_client *client) {
+    struct wl_listener *listener = wl_client_get_destroy_listener(
+        client, client_account_on_destroy);
+    if (!listener)
+        return NULL;
+    ClientAccount *account = wl_container_of(listener, account, on_destroy);
+    return account;
+}
+
+static ClientAccount *account_get(Server *srv, struct wl_client *client) {
+    ClientAccount *account = account_find(client);
+    if (account)
+        return account;
+    account = pool_alloc(&client_account_pool);
+    if (!account)
+        return NULL;
+    *account = (ClientAccount) {
+        .client = client,
+        .on_destroy.notify = client_account_on_destroy,
+    };
+    wl_client_get_credentials(client, &account->pid, NULL, NULL);
+    wl_client_add_destroy_listener(client, &account->on_destroy);
+    wl_list_insert(&srv->accounts, &account->link);
+    return account;
+}
+
+void account_add(Server *srv, struct wl_client *client, AccountType type,
+    uint64_t bytes)
+{
+    ClientAccount *account = account_get(srv, client);
+    if (!account)
+        return;
+    account->count[type]++;
+    account->bytes[type] += bytes;
+    if (account->killed)
+        return;
+    if ((account_max_count[type] && account->count[type] > account_max_count[type])
+        || (account_max_bytes[type] && account->bytes[type] > account_max_bytes[type]))
+    {
+        wlr_log(WLR_ERROR, "client %d holds %llu %s (%llu KiB), "
+            "disconnecting it", (int)account->pid,
+            (unsigned long long)account->count[type], account_type_names[type],
+            (unsigned long long)(account->bytes[type] / 1024));
+        account->killed = true;
+        wl_client_post_no_memory(client);
+    }
+}
+
+void account_remove(Server *srv, struct wl_client *client, AccountType type,
+    uint64_t bytes)
+{
+    ClientAccount *account = account_find(client);
+    if (!account)
+        return;
+    account->count[type]--;
+    account->bytes[type] -= bytes;
+}
+
+static int account_max_refresh_hz(Server *srv) {
+    int refresh = 0;
+    Output *out;
+    wl_list_for_each (out, &srv->outputs, link) {
+        if (out->output->refresh > refresh)
+            refresh = out->output->refresh;
+    }
+    return refresh > 0 ? (refresh + 500) / 1000 : 60;
+}
+
+// Counts a surface commit, and once a second whether the client commits
+// so much faster than anything can be shown that it's wasting our time.
+void account_commit(Server *srv, struct wl_client *client) {
+    ClientAccount *account = account_get(srv, client);
+    if (!account)
+        return;
+    account->commits++;
+    int64_t now = now_usec();
+    int64_t elapsed = now - account->window_start;
+    if (account->window_start == 0) {
+        account->window_start = now;
+        return;
+    }
+    if (elapsed < 1000000)
+        return;
+    account->commit_rate = account->commits * 1000000 / elapsed;
+    account->commits = 0;
+    account->window_start = now;
+    bool runaway = account->commit_rate
+        > (uint32_t)account_max_refresh_hz(srv) * ACCOUNT_RUNAWAY_FACTOR;
+    if (runaway && !account->runaway) {
+        wlr_log(WLR_INFO, "client %d commits %u times a second, throttling it",
+            (int)account->pid, account->commit_rate);
+    }
+    account->runaway = runaway;
+}
+
+bool account_runaway(struct wl_client *client) {
+    ClientAccount *account = account_find(client);
+    return account && account->runaway;
+}
+
+// The whole compositor's resident memory, or -1 if it can't be read.
+long account_rss_kib(void) {
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f)
+        return -1;
+    long size, resident;
+    int n = fscanf(f, "%ld %ld", &size, &resident);
+    fclose(f);
+    if (n != 2)
+        return -1;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+void account_dump(Server *srv) {
+    wlr_log(WLR_INFO, "rss: %ld KiB", account_rss_kib());
+    ClientAccount *account;
+    wl_list_for_each (account, &srv->accounts, link) {
+        char line[256];
+        int len = snprintf(line, sizeof(line), "client %d:", (int)account->pid);
+        for (int i = 0; i < ACCOUNT_TYPES && len < (int)sizeof(line); i++) {
+            len += snprintf(line + len, sizeof(line) - len, " %llu %s (%llu KiB)",
+                (unsigned long long)account->count[i], account_type_names[i],
+                (unsigned long long)(account->bytes[i] / 1024));
+        }
+        if (len < (int)sizeof(line)) {
+            snprintf(line + len, sizeof(line) - len, ", %u commits/s%s",
+                account->commit_rate, account->runaway ? " (throttled)" : "");
+        }
+        wlr_log(WLR_INFO, "%s", line);
+    }
+}
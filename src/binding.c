@@ -0,0 +1,173 @@
+#include "bitter.h"
+#include <sys/wait.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <wlr/types/wlr_keyboard.h>
+#include <wlr/util/log.h>
+#include <xkbcommon/xkbcommon.h>
+
+// Compositor key bindings, looked up by keysym and modifiers in an open
+// addressing hash table that's filled once at startup.
+
+#define BINDING_MODIFIERS \
+    (WLR_MODIFIER_SHIFT | WLR_MODIFIER_CTRL | WLR_MODIFIER_ALT \
+        | WLR_MODIFIER_LOGO)
+
+static uint32_t binding_hash(uint32_t modifiers, xkb_keysym_t keysym) {
+    uint32_t h = keysym * 2654435761u ^ modifiers * 40503u;
+    return h ^ (h >> 16);
+}
+
+static void binding_add(Server *srv, uint32_t modifiers, xkb_keysym_t keysym,
+    BindingAction action, const char *arg)
+{
+    uint32_t i = binding_hash(modifiers, keysym);
+    for (int n = 0; n < BINDING_TABLE_SIZE; n++, i++) {
+        Binding *slot = &srv->bindings[i % BINDING_TABLE_SIZE];
+        if (slot->keysym != XKB_KEY_NoSymbol
+            && (slot->keysym != keysym || slot->modifiers != modifiers))
+            continue;
+        *slot = (Binding) {
+            .modifiers = modifiers,
+            .keysym = keysym,
+            .action = action,
+            .arg = arg,
+        };
+        return;
+    }
+    wlr_log(WLR_ERROR, "binding table full");
+}
+
+static Binding *binding_find(Server *srv, uint32_t modifiers,
+    xkb_keysym_t keysym)
+{
+    uint32_t i = binding_hash(modifiers, keysym);
+    for (int n = 0; n < BINDING_TABLE_SIZE; n++, i++) {
+        Binding *slot = &srv->bindings[i % BINDING_TABLE_SIZE];
+        if (slot->keysym == XKB_KEY_NoSymbol)
+            return NULL;
+        if (slot->keysym == keysym && slot->modifiers == modifiers)
+            return slot;
+    }
+    return NULL;
+}
+
+void binding_init(Server *srv) {
+    const char *terminal = getenv("BITTER_TERMINAL");
+    uint32_t logo = WLR_MODIFIER_LOGO;
+    uint32_t logo_shift = WLR_MODIFIER_LOGO | WLR_MODIFIER_SHIFT;
+    binding_add(srv, logo, XKB_KEY_Return, BindingSpawn,
+        terminal ? terminal : "alacritty");
+    binding_add(srv, logo_shift, XKB_KEY_Q, BindingClose, NULL);
+    binding_add(srv, logo_shift, XKB_KEY_Escape, BindingQuit, NULL);
+    binding_add(srv, logo, XKB_KEY_h, BindingSplitHorizontal, NULL);
+    binding_add(srv, logo, XKB_KEY_v, BindingSplitVertical, NULL);
+    binding_add(srv, logo, XKB_KEY_equal, BindingGrow, NULL);
+    binding_add(srv, logo, XKB_KEY_minus, BindingShrink, NULL);
+    binding_add(srv, logo_shift, XKB_KEY_J, BindingSwapNext, NULL);
+}
+
+// The event loop blocks the signals it watches, and exec keeps both the
+// mask and ignored signals, so spawned programs would inherit them.
+static void reset_signals(void) {
+    struct sigaction action = { .sa_handler = SIG_DFL };
+    sigemptyset(&action.sa_mask);
+    // fails for the signals that can't be caught, which is fine
+    for (int sig = 1; sig <= SIGRTMAX; sig++)
+        sigaction(sig, &action, NULL);
+    sigset_t set;
+    sigemptyset(&set);
+    sigprocmask(SIG_SETMASK, &set, NULL);
+}
+
+static void spawn(const char *command) {
+    // fork twice so the child is reparented and never left a zombie
+    pid_t pid = fork();
+    if (pid == 0) {
+        setsid();
+        if (fork() == 0) {
+            reset_signals();
+            execl("/bin/sh", "/bin/sh", "-c", command, NULL);
+            _exit(127);
+        }
+        _exit(0);
+    }
+    if (pid > 0)
+        waitpid(pid, NULL, 0);
+}
+
+// Also what IPC commands run, with arguments from the request.
+void binding_run(Server *srv, BindingAction action, const char *arg) {
+    Node *focused = srv->focused;
+    Node *leaf = focused && focused->kind == NodeLeaf ? focused : NULL;
+    switch (action) {
+        case BindingSpawn: {
+            if (arg)
+                spawn(arg);
+            break;
+        }
+        case BindingClose: {
+            if (leaf && leaf->view)
+                view_close(leaf->view);
+            break;
+        }
+        case BindingQuit: {
+            wl_display_terminate(srv->display);
+            break;
+        }
+        case BindingSplitHorizontal:
+        case BindingSplitVertical: {
+            if (!leaf)
+                break;
+            node_split(leaf, action == BindingSplitHorizontal
+                ? NodeHorizontal : NodeVertical);
+            server_reconfigure_node(srv, leaf);
+            break;
+        }
+        case BindingGrow:
+        case BindingShrink: {
+            if (!leaf)
+                break;
+            node_set_weight(leaf, action == BindingGrow
+                ? leaf->weight * 1.25 : leaf->weight / 1.25);
+            server_reconfigure_node(srv, leaf);
+            break;
+        }
+        case BindingSwapNext: {
+            if (!leaf)
+                break;
+            Node *next = node_next_leaf(leaf);
+            if (next == leaf || next->kind != NodeLeaf)
+                break;
+            node_swap(leaf, next);
+            // focus stays with the view that moved
+            srv->focused = next;
+            server_reconfigure_node(srv, leaf);
+            break;
+        }
+        case BINDING_ACTIONS: {
+            break;
+        }
+    }
+}
+
+// Runs the binding for a key press, if there is one.
+bool binding_handle(Server *srv, struct wlr_keyboard *keyboard,
+    uint32_t keycode)
+{
+    uint32_t modifiers = wlr_keyboard_get_modifiers(keyboard)
+        & BINDING_MODIFIERS;
+    if (modifiers == 0)
+        return false;
+    const xkb_keysym_t *syms;
+    int nsyms = xkb_state_key_get_syms(keyboard->xkb_state, keycode, &syms);
+    for (int i = 0; i < nsyms; i++) {
+        Binding *binding = binding_find(srv, modifiers, syms[i]);
+        if (binding) {
+            binding_run(srv, binding->action, binding->arg);
+            return true;
+        }
+    }
+    return false;
+}
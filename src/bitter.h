@@ -1,11 +1,17 @@
 #pragma once
 
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
 #include <wayland-server-core.h>
 #include <wlr/interfaces/wlr_input_device.h>
 #include <wlr/interfaces/wlr_output.h>
+#include <wlr/types/wlr_output_damage.h>
 #include <wlr/types/wlr_xdg_shell.h>
+#include <xkbcommon/xkbcommon.h>
 
 #define NOTIFY(type, prefix, name)                                         \
     __attribute__((__flatten__)) __attribute__((__unused__)) static inline \
@@ -14,24 +20,243 @@
         prefix##_##name(ptr, data);                                        \
     }
 
+#define POOL_SLAB_OBJECTS 64
+
+typedef struct Pool {
+    const char *name;
+    size_t size;
+    struct PoolSlab *slabs;
+    struct PoolFree *free;
+    size_t live, peak, capacity;
+    uint64_t allocs;
+} Pool;
+
+extern Pool node_pool;
+extern Pool xdg_surface_pool;
+extern Pool xdg_popup_pool;
+extern Pool subsurface_pool;
+extern Pool keyboard_pool;
+extern Pool output_pool;
+extern Pool upload_tracker_pool;
+extern Pool client_account_pool;
+
+void *pool_alloc(Pool *);
+void pool_free(Pool *, void *);
+void pool_finish_all(void);
+void pool_dump_all(void);
+
+typedef enum BindingAction {
+    BindingSpawn,
+    BindingClose,
+    BindingQuit,
+    BindingSplitHorizontal,
+    BindingSplitVertical,
+    BindingGrow,
+    BindingShrink,
+    BindingSwapNext,
+    BINDING_ACTIONS,
+} BindingAction;
+
+typedef struct Binding {
+    uint32_t modifiers;
+    xkb_keysym_t keysym; // XKB_KEY_NoSymbol for empty slots
+    BindingAction action;
+    const char *arg;
+} Binding;
+
+#define BINDING_TABLE_SIZE 64
+
+typedef enum AccountType {
+    AccountSurface,
+    AccountView,
+    AccountPopup,
+    AccountTexture, // bytes of the texture each surface's buffer is in
+    ACCOUNT_TYPES,
+} AccountType;
+
+typedef struct ClientAccount {
+    struct wl_client *client;
+    pid_t pid;
+    uint64_t count[ACCOUNT_TYPES];
+    uint64_t bytes[ACCOUNT_TYPES];
+    bool killed; // went over a limit and was sent an error
+    // surface commits counted over one-second windows
+    uint32_t commits;
+    uint32_t commit_rate; // per second, over the last window
+    int64_t window_start; // usec
+    bool runaway; // commits far faster than any output refreshes
+    struct wl_listener on_destroy;
+    struct wl_list link;
+} ClientAccount;
+
+// The IPC wire format. Every message is an IpcHeader followed by length
+// bytes of payload, in host byte order since both ends are on this machine.
+typedef enum IpcType {
+    IpcGetTree = 1, // reply: per output, an IpcOutputRecord and its nodes
+    IpcGetOutputs, // reply: an IpcOutputRecord per output, with no nodes
+    IpcCommand, // IpcCommandRequest, then the argument; reply: uint32_t status
+    IpcSubscribe, // uint32_t mask of IPC_EVENT_*; reply: uint32_t status
+    IpcEventLayout = 0x80, // as IpcGetTree, once per dispatch at most
+    IpcEventFocus, // uint32_t view id, or 0
+    IpcEventOutputs, // as IpcGetOutputs
+    IpcError = 0xff, // uint32_t type of the request that wasn't understood
+} IpcType;
+
+#define IPC_EVENT(type) (1u << ((type) - IpcEventLayout))
+#define IPC_EVENTS (IPC_EVENT(IpcEventLayout) | IPC_EVENT(IpcEventFocus) \
+    | IPC_EVENT(IpcEventOutputs))
+
+typedef struct IpcHeader {
+    uint32_t length;
+    uint32_t type;
+} IpcHeader;
+
+typedef struct IpcOutputRecord {
+    char name[24];
+    int32_t x, y, width, height; // layout coordinates
+    int32_t refresh; // mHz
+    float scale;
+    uint32_t adaptive_sync;
+    uint32_t nodes; // IpcNodeRecords that follow, depth first
+} IpcOutputRecord;
+
+typedef struct IpcNodeRecord {
+    uint32_t kind; // NodeKind
+    uint32_t children; // the next records that are direct children
+    uint32_t view; // for leaves, or 0
+    uint32_t focused;
+    int32_t x, y, width, height; // output-local layout coordinates
+    float weight;
+} IpcNodeRecord;
+
+typedef struct IpcCommandRequest {
+    uint32_t action; // BindingAction
+    uint32_t view; // focused first if nonzero, otherwise the focused view
+    // followed by a NUL-terminated argument for BindingSpawn
+} IpcCommandRequest;
+
+#define IPC_BUFFER_SIZE 65536
+#define IPC_MAX_BACKLOG (4 << 20) // unsent bytes before a reader is dropped
+
+typedef struct IpcClient {
+    struct Server *srv;
+    int fd;
+    struct wl_event_source *source;
+    uint32_t mask; // what the source is polled for
+    uint32_t events; // IPC_EVENT_* subscribed to
+    // requests are handled in place, only a partial one is moved to the front
+    uint8_t in[IPC_BUFFER_SIZE];
+    size_t in_len;
+    // replies and events queued until the end of the dispatch
+    struct wl_array out;
+    size_t out_pos;
+    struct wl_list link;
+} IpcClient;
+
+// A client committing this many times faster than the fastest output
+// refreshes is throttled as if unfocused.
+#define ACCOUNT_RUNAWAY_FACTOR 4
+#define THROTTLE_UNFOCUSED_HZ 30 // default, overridden by BITTER_UNFOCUSED_HZ
+#define THROTTLE_HIDDEN_HZ 1
+
+#define STARTUP_MARKS 16
+
+typedef struct StartupMark {
+    const char *name;
+    int64_t usec; // since server_create was called
+} StartupMark;
+
+struct Output;
+
 typedef struct Server {
     struct wl_display *display;
+    const char *socket;
     struct wlr_backend *backend;
     struct wlr_renderer *renderer;
     struct wlr_output_layout *output_layout;
     struct wlr_xdg_shell *xdg_shell;
     struct wlr_cursor *cursor;
-    struct wlr_xcursor_manager *xcursor_manager;
+    struct wlr_xcursor_manager *xcursor_manager; // NULL while loading
+    struct {
+        pthread_t thread;
+        bool running;
+        int fds[2];
+        struct wl_event_source *source;
+        struct wlr_xcursor_manager *loading;
+    } cursor_theme;
     struct wlr_seat *seat;
+    struct wlr_compositor *compositor;
+    struct wlr_relative_pointer_manager_v1 *relative_pointer;
+    struct wlr_screencopy_manager_v1 *screencopy;
+    struct wlr_export_dmabuf_manager_v1 *export_dmabuf;
     struct wl_list keyboards;
+    struct xkb_rule_names xkb_rules; // from XKB_DEFAULT_*, for new keyboards
+    struct xkb_context *xkb_context;
+    struct wl_list keymaps;
+    Binding bindings[BINDING_TABLE_SIZE];
+    struct {
+        pthread_t thread;
+        bool running;
+        int fds[2];
+        struct wl_event_source *source;
+        struct xkb_keymap *keymap;
+    } precompile;
     struct wl_list outputs;
     struct wl_listener on_new_input;
     struct wl_listener on_new_output;
     struct wl_listener on_new_xdg_surface;
     struct wl_listener on_cursor_motion;
+    struct wl_listener on_cursor_motion_absolute;
     struct wl_listener on_cursor_button;
+    struct wl_listener on_cursor_axis;
+    struct wl_listener on_cursor_frame;
+    struct wl_listener on_request_set_cursor;
+    struct wl_listener on_new_surface;
+    uint64_t upload_bytes; // copied from SHM buffers into textures, ever
+    // relative motion accumulated since the last flush, applied at most
+    // once per event loop dispatch
+    struct {
+        struct wlr_input_device *device;
+        double dx, dy;
+        uint32_t time_msec;
+        bool frame; // a pointer frame is owed after the flush
+        struct wl_event_source *idle;
+    } motion;
+    const char *cursor_image; // NULL while a client sets the cursor
     struct Node *focused;
+    struct View *hovered; // view under the cursor, if any
     // TODO: make a linked list of last focused nodes
+    bool debug_damage; // tint repainted regions, set by BITTER_DEBUG_DAMAGE
+    int render_delay; // default for new outputs, set by BITTER_RENDER_DELAY
+    bool overlay; // draw frame timings on screen, set by BITTER_OVERLAY
+    bool adaptive_sync; // unset by BITTER_NO_ADAPTIVE_SYNC
+    bool cpu_composite; // set by BITTER_CPU_COMPOSITE
+    int unfocused_hz; // frame callback rate for unfocused views, 0 for any
+    struct wl_event_source *stats_signal;
+    struct timespec startup_time;
+    StartupMark startup[STARTUP_MARKS];
+    int startup_len;
+    bool started; // the first frame is out and the timeline logged
+    struct wl_list accounts; // ClientAccount
+    struct wl_array orphans; // View *, tiled views with no output to go on
+    struct wl_event_source *layout_idle; // outputs with layout_dirty pending
+    struct {
+        struct wl_list views; // View.txn.link, views with a pending box
+        int waiting; // views whose client hasn't caught up yet
+        struct wl_event_source *timer;
+        bool timer_armed;
+    } txn;
+    uint32_t next_view_id;
+    struct {
+        int fd; // -1 without a socket
+        char *path;
+        struct wl_event_source *source;
+        struct wl_list clients; // IpcClient
+        struct wl_event_source *flush_idle;
+        uint32_t events; // IPC_EVENT_* pending for subscribers
+        uint32_t focused_view; // as last sent
+        struct wl_array scratch; // an event, encoded once for everyone
+    } ipc;
 } Server;
 
 Server *server_create(void);
@@ -41,19 +266,73 @@ void server_new_input(Server *, struct wlr_input_device *);
 void server_new_output(Server *, struct wlr_output *);
 void server_new_xdg_surface(Server *, struct wlr_xdg_surface *);
 void server_cursor_motion(Server *, struct wlr_event_pointer_motion *);
+void server_cursor_motion_absolute(Server *,
+    struct wlr_event_pointer_motion_absolute *);
 void server_cursor_button(Server *, struct wlr_event_pointer_button *);
+void server_cursor_axis(Server *, struct wlr_event_pointer_axis *);
+void server_cursor_frame(Server *, void *);
+void server_new_surface(Server *, struct wlr_surface *);
+void server_request_set_cursor(Server *,
+    struct wlr_seat_pointer_request_set_cursor_event *);
+void server_flush_motion(Server *);
+void server_set_cursor_image(Server *, const char *name);
+void server_update_pointer(Server *, uint32_t time_msec);
 void server_update_capabilities(Server *);
-void server_reconfigure_outputs(Server *);
+void server_reconfigure_output(Server *, struct Output *);
+void server_reconfigure_node(Server *, struct Node *);
+void server_flush_layout(Server *);
+void server_adopt_view(Server *, struct View *);
+void server_forget_orphan(Server *, struct View *);
 
 NOTIFY(Server, server, new_input)
 NOTIFY(Server, server, new_output)
 NOTIFY(Server, server, new_xdg_surface)
 NOTIFY(Server, server, cursor_motion)
+NOTIFY(Server, server, cursor_motion_absolute)
 NOTIFY(Server, server, cursor_button)
+NOTIFY(Server, server, cursor_axis)
+NOTIFY(Server, server, cursor_frame)
+NOTIFY(Server, server, request_set_cursor)
+NOTIFY(Server, server, new_surface)
+
+void account_add(Server *, struct wl_client *, AccountType, uint64_t bytes);
+void account_remove(Server *, struct wl_client *, AccountType,
+    uint64_t bytes);
+void account_dump(Server *);
+void account_commit(Server *, struct wl_client *);
+bool account_runaway(struct wl_client *);
+long account_rss_kib(void);
+void client_account_destroy(ClientAccount *, void *);
+
+NOTIFY(ClientAccount, client_account, destroy)
+
+typedef struct Keymap {
+    struct xkb_rule_names rules;
+    struct xkb_keymap *keymap;
+    struct wl_list link;
+} Keymap;
+
+void keymap_init(Server *);
+void keymap_finish(Server *);
+struct xkb_keymap *keymap_get(Server *, const struct xkb_rule_names *);
+
+void binding_init(Server *);
+bool binding_handle(Server *, struct wlr_keyboard *, uint32_t keycode);
+void binding_run(Server *, BindingAction, const char *arg);
+
+void ipc_init(Server *);
+void ipc_finish(Server *);
+void ipc_notify(Server *, uint32_t events);
+
+#define KEYBOARD_KEYCODES 768
 
 typedef struct Keyboard {
     Server *srv;
     struct wlr_input_device *device;
+    // presses that ran a binding, so their releases aren't forwarded either
+    uint8_t consumed[KEYBOARD_KEYCODES / 8];
+    bool modifiers_pending;
+    struct wl_event_source *modifiers_idle;
     struct wl_listener on_key;
     struct wl_listener on_modifiers;
     struct wl_listener on_destroy;
@@ -69,20 +348,235 @@ NOTIFY(Keyboard, keyboard, key)
 NOTIFY(Keyboard, keyboard, modifiers)
 NOTIFY(Keyboard, keyboard, destroy)
 
+#define STATS_RING_LEN 256
+#define HISTOGRAM_BUCKETS 240
+#define STATS_OVERLAY_SAMPLES 128
+#define STATS_OVERLAY_HEIGHT 64
+
+typedef struct FrameSample {
+    uint32_t render_usec;
+    uint32_t upload_bytes; // texture uploads since the output's last frame
+    uint16_t surfaces; // on screen
+    uint16_t drawn; // intersecting damage
+} FrameSample;
+
+typedef struct Histogram {
+    uint64_t counts[HISTOGRAM_BUCKETS];
+    uint64_t total;
+    uint32_t max;
+} Histogram;
+
+// Written only from the main thread. The ring's head is published with
+// release semantics so it can be read from elsewhere without locking.
+typedef struct OutputStats {
+    FrameSample ring[STATS_RING_LEN];
+    _Atomic uint32_t head;
+    Histogram render; // microseconds
+    Histogram present; // microseconds from commit to presentation
+    uint64_t frames; // rendered and committed
+    uint64_t scanout; // committed a client's buffer directly
+    uint64_t dropped;
+    struct timespec commit_time;
+    uint32_t commit_seq;
+    uint64_t upload_seen; // Server.upload_bytes at the last frame
+    struct {
+        uint64_t shm, dmabuf; // frames served
+        uint64_t bytes; // read back into SHM buffers
+        uint64_t usec; // committing frames that served any
+    } capture;
+} OutputStats;
+
+int64_t timespec_to_usec(const struct timespec *);
+int64_t now_usec(void);
+uint32_t histogram_percentile(Histogram *, double fraction);
+void stats_init(Server *);
+void startup_mark_at(Server *, const char *name, struct timespec *);
+void startup_mark(Server *, const char *name);
+void startup_dump(Server *);
+void startup_first_frame(Server *);
+void cursor_theme_init(Server *);
+void cursor_theme_finish(Server *);
+void stats_finish(Server *);
+void stats_dump(Server *);
+void stats_record_frame(OutputStats *, int render_usec, int surfaces,
+    int drawn, uint64_t upload_bytes);
+void stats_record_commit(OutputStats *, uint32_t commit_seq);
+void stats_record_present(OutputStats *, struct wlr_output_event_present *);
+void stats_overlay_box(struct Output *, struct wlr_box *);
+void stats_render_overlay(struct Output *);
+
+// Counts what each commit to an SHM-backed surface costs to upload.
+typedef struct UploadTracker {
+    struct Server *srv;
+    struct wlr_surface *surface;
+    struct wl_client *client;
+    int buffer_width, buffer_height;
+    uint64_t texture_bytes; // accounted to the client
+    // the buffer as of the last commit, kept for compositing on the CPU
+    struct {
+        uint32_t *pixels;
+        int width, height; // 0 while there's no usable copy
+        bool opaque; // XRGB, so alpha is to be ignored
+    } cpu;
+    struct wl_listener on_commit;
+    struct wl_listener on_destroy;
+} UploadTracker;
+
+UploadTracker *upload_tracker_create(struct Server *, struct wlr_surface *);
+UploadTracker *upload_tracker_from_surface(struct wlr_surface *);
+void upload_tracker_commit(UploadTracker *, void *);
+void upload_tracker_destroy(UploadTracker *, void *);
+
+NOTIFY(UploadTracker, upload_tracker, commit)
+NOTIFY(UploadTracker, upload_tracker, destroy)
+
+// Row operations on 32-bit pixels, in one variant per instruction set.
+typedef struct CompositeKernels {
+    const char *name;
+    const char *isa; // for __builtin_cpu_supports, or NULL for any CPU
+    void (*copy)(uint32_t *dst, const uint32_t *src, int len); // alpha set
+    void (*blend)(uint32_t *dst, const uint32_t *src, int len); // over
+} CompositeKernels;
+
+extern const CompositeKernels composite_kernels[];
+extern const int composite_kernels_len;
+
+bool composite_kernels_supported(const CompositeKernels *);
+void composite_init(Server *);
+void composite_surface_commit(UploadTracker *);
+void composite_surface_finish(UploadTracker *);
+struct wlr_texture *composite_frame(struct Output *, pixman_region32_t *damage,
+    pixman_region32_t *opaque, int *drawn);
+void composite_output_finish(struct Output *);
+
+// The captures a commit is about to serve, counted before wlroots does so.
+typedef struct CaptureCensus {
+    int shm, dmabuf;
+    uint64_t bytes;
+} CaptureCensus;
+
+void capture_init(Server *);
+bool capture_pending(struct Output *);
+void capture_census(struct Output *, bool damaged, CaptureCensus *);
+void capture_record(struct Output *, CaptureCensus *, int64_t usec);
+
+// A surface in the scene, with everything cached that doesn't change until
+// it's committed to or moved.
+typedef struct SceneItem {
+    struct View *view;
+    struct wlr_surface *surface; // NULL once destroyed
+    struct wl_listener on_destroy;
+    struct wlr_box box; // output-local layout coordinates
+    struct wlr_box buffer_box;
+    float matrix[9];
+    pixman_region32_t opaque; // buffer coordinates
+} SceneItem;
+
+void scene_item_destroy(SceneItem *, void *);
+
+NOTIFY(SceneItem, scene_item, destroy)
+
+// An on-screen surface and the part of it not hidden by anything above,
+// both in output buffer coordinates. Rebuilt every frame.
+typedef struct RenderItem {
+    struct wlr_surface *surface;
+    struct wlr_texture *texture;
+    SceneItem *scene;
+    pixman_region32_t visible;
+} RenderItem;
+
+#define GRID_CELLS 16
+
+// Views bucketed by which cells of a uniform grid over the output their
+// bounds overlap, so finding what's under the pointer only looks at the
+// few views sharing its cell. Rebuilt lazily after anything moves.
+typedef struct ViewGrid {
+    struct wlr_box box;
+    int cell_width, cell_height;
+    struct wl_array cells[GRID_CELLS * GRID_CELLS]; // View *, bottom to top
+    bool dirty;
+} ViewGrid;
+
+void grid_init(ViewGrid *);
+void grid_finish(ViewGrid *);
+void grid_rebuild(ViewGrid *, struct Node *root, struct wlr_box *);
+struct View *grid_view_at(ViewGrid *, double x, double y,
+    struct wlr_surface **surface, double *sx, double *sy);
+
+#define RENDER_DELAY_AUTO -1
+#define RENDER_MARGIN_USEC 1000
+#define RENDER_TIMES_LEN 16
+
 typedef struct Output {
     Server *srv;
     struct Node *root;
     struct wlr_output *output;
+    struct wlr_output_damage *damage;
+    pixman_region32_t debug_tint;
+    // milliseconds between the frame event and rendering, or
+    // RENDER_DELAY_AUTO to predict it from recent render times
+    int render_delay;
+    bool render_pending;
+    int64_t render_deadline; // when the pending render must be done, in usec
+    struct wl_event_source *render_timer;
+    // brings a frame back for throttled surfaces still waiting on callbacks
+    struct wl_event_source *throttle_timer;
+    int render_times[RENDER_TIMES_LEN]; // microseconds
+    int render_times_pos;
+    int render_times_len;
+    bool scanout; // whether a client buffer was last put on screen directly
+    bool layout_dirty; // arranged on the next layout flush
+    struct wl_array render_items; // RenderItem, kept to reuse its storage
+    struct {
+        struct wl_array views; // View *, bottom to top
+        bool dirty; // views were added, removed or reordered
+        // what the cached matrices were computed for
+        float scale;
+        enum wl_output_transform transform;
+        int width, height;
+    } scene;
+    ViewGrid grid;
+    // the frame as composited on the CPU, and the texture it's uploaded to
+    struct {
+        uint32_t *pixels;
+        int width, height;
+        struct wlr_texture *texture;
+        bool valid; // false after a frame drawn some other way
+    } cpu;
+    OutputStats stats;
     struct wl_listener on_frame;
+    struct wl_listener on_present;
+    struct wl_listener on_mode;
+    struct wl_listener on_scale;
+    struct wl_listener on_transform;
+    struct wl_listener on_destroy;
     struct wl_list link;
 } Output;
 
 Output *output_create(Server *, struct wlr_output *);
-void output_destroy(Output *);
+void output_destroy(Output *, void *);
 void output_frame(Output *, void *data);
+void output_present(Output *, struct wlr_output_event_present *);
+void output_mode(Output *, void *);
+void output_scale(Output *, void *);
+void output_transform(Output *, void *);
+void output_render(Output *);
 void output_configure(Output *);
+void output_get_box(Output *, struct wlr_box *);
+void scale_box(struct wlr_box *, float scale);
+void output_damage_whole(Output *);
+void output_damage_box(Output *, struct wlr_box *);
+void output_damage_surface(Output *, struct wlr_surface *, int x, int y,
+    bool whole);
+struct View *output_view_at(Output *, double x, double y,
+    struct wlr_surface **surface, double *sx, double *sy);
 
 NOTIFY(Output, output, frame)
+NOTIFY(Output, output, present)
+NOTIFY(Output, output, mode)
+NOTIFY(Output, output, scale)
+NOTIFY(Output, output, transform)
+NOTIFY(Output, output, destroy)
 
 typedef enum ViewKind {
     ViewXdgSurface,
@@ -91,10 +585,30 @@ typedef enum ViewKind {
 typedef struct View {
     Server *srv;
     ViewKind kind;
+    uint32_t id; // never reused, for IPC
     struct ViewImpl *impl;
+    // where the view was last configured, in output-local layout coordinates
+    Output *out;
+    struct wlr_box box;
+    struct wlr_box bounds; // all of its surfaces, popups included
+    int width, height; // last size sent to the client
+    int64_t frame_done; // usec, when throttled frame callbacks last went out
+    struct {
+        struct wl_array items; // SceneItem, bottom to top
+        bool dirty;
+    } scene;
+    // where the view will go once the current transaction applies
+    struct {
+        struct wl_list link;
+        bool pending;
+        Output *out;
+        struct wlr_box box;
+        uint32_t serial; // configure the client has yet to ack, or 0
+    } txn;
+
     union {
         struct {
-            struct wl_list link;
+            struct Node *node; // leaf holding the view
         } tiled;
     };
 } View;
@@ -103,46 +617,130 @@ typedef struct ViewImpl {
     uint32_t (*set_size)(View *, int width, int height);
     uint32_t (*set_tiled)(View *, bool);
     void (*for_each_surface)(View *, wlr_surface_iterator_func_t, void *data);
+    void (*get_origin)(View *, int *x, int *y);
+    struct wlr_surface *(*get_surface)(View *); // toplevel, for focus
+    struct wlr_surface *(*surface_at)(View *, double x, double y,
+        double *sx, double *sy);
+    void (*close)(View *);
 } ViewImpl;
 
 uint32_t view_set_size(View *, int width, int height);
 uint32_t view_set_tiled(View *, bool);
 void view_for_each_surface(View *, wlr_surface_iterator_func_t, void *data);
+void view_get_origin(View *, int *x, int *y);
+struct wlr_surface *view_get_surface(View *);
+struct wlr_surface *view_surface_at(View *, double x, double y,
+    double *sx, double *sy);
+void view_close(View *);
+void view_damage(View *, bool whole);
+void view_update_bounds(View *);
+
+void scene_update(Output *);
+void scene_view_finish(View *);
+
+#define TRANSACTION_TIMEOUT_MSEC 200
+
+void transaction_init(Server *);
+void transaction_finish(Server *);
+void transaction_add_view(View *, Output *, struct wlr_box *);
+void transaction_commit(Server *);
+void transaction_apply(Server *);
+void transaction_view_ready(View *, uint32_t acked_serial);
+void transaction_remove_view(View *);
+bool transaction_blocks_output(Server *, Output *);
 
 typedef struct XdgSurface {
     View base;
     struct wlr_xdg_surface *surface;
+    struct wl_listener on_commit;
+    struct wl_listener on_new_subsurface;
     struct wl_listener on_destroy;
 } XdgSurface;
 
 XdgSurface *xdg_surface_create(Server *, struct wlr_xdg_surface *);
 XdgSurface *xdg_surface_from_view(View *);
+XdgSurface *xdg_surface_from_wlr_surface(struct wlr_surface *);
+void xdg_surface_commit(XdgSurface *, void *);
+void xdg_surface_new_subsurface(XdgSurface *, void *);
 void xdg_surface_destroy(XdgSurface *, void *);
 
+NOTIFY(XdgSurface, xdg_surface, commit)
+NOTIFY(XdgSurface, xdg_surface, new_subsurface)
 NOTIFY(XdgSurface, xdg_surface, destroy)
 
+// Popups are drawn as part of the view they belong to, this only forwards
+// their damage. The view is looked up through the parent surfaces each
+// time, since it can go away while the popup is still around.
+typedef struct XdgPopup {
+    Server *srv;
+    struct wlr_xdg_surface *surface;
+    struct wl_listener on_commit;
+    struct wl_listener on_new_subsurface;
+    struct wl_listener on_destroy;
+} XdgPopup;
+
+XdgPopup *xdg_popup_create(Server *, struct wlr_xdg_surface *);
+void xdg_popup_commit(XdgPopup *, void *);
+void xdg_popup_new_subsurface(XdgPopup *, void *);
+void xdg_popup_destroy(XdgPopup *, void *);
+
+NOTIFY(XdgPopup, xdg_popup, commit)
+NOTIFY(XdgPopup, xdg_popup, new_subsurface)
+NOTIFY(XdgPopup, xdg_popup, destroy)
+
+// Subsurfaces are drawn as part of their view as well. Desynchronized ones
+// commit on their own, without the view's surface committing along, so
+// their damage has to be forwarded separately.
+typedef struct Subsurface {
+    Server *srv;
+    struct wlr_subsurface *subsurface;
+    struct wl_listener on_commit;
+    struct wl_listener on_new_subsurface;
+    struct wl_listener on_destroy;
+} Subsurface;
+
+Subsurface *subsurface_create(Server *, struct wlr_subsurface *);
+void subsurface_create_children(Server *, struct wlr_surface *);
+void subsurface_commit(Subsurface *, void *);
+void subsurface_new_subsurface(Subsurface *, void *);
+void subsurface_destroy(Subsurface *, void *);
+
+NOTIFY(Subsurface, subsurface, commit)
+NOTIFY(Subsurface, subsurface, new_subsurface)
+NOTIFY(Subsurface, subsurface, destroy)
+
 typedef enum NodeKind {
     NodeHorizontal,
     NodeVertical,
-    NodeTerminalHorizontal,
-    NodeTerminalVertical,
+    NodeLeaf,
 } NodeKind;
 
 typedef struct Node {
     NodeKind kind;
+    struct Node *parent;
+    struct wl_list link; // parent's children
+    // geometry from the last arrange, only recomputed once dirty
+    struct wlr_box box;
+    bool dirty;
+    double weight; // share of the parent's space, relative to siblings
     union {
         struct {
-            struct Node *left;
-            struct Node *right;
+            struct wl_list children;
+            int len;
+            double total_weight;
         };
-        struct wl_list children;
+        View *view; // for leaves, NULL while being removed
     };
 } Node;
 
-Node *node_create(void);
+Node *node_create(NodeKind);
 void node_destroy(Node *);
-Node *node_insert(Node *, View *);
-void node_walk(Node *,
-    void (*visit)(struct wl_list *link, struct wlr_box *box, void *data),
-    struct wlr_box *box, void *data);
-void node_configure(Node *n, struct wlr_box *);
+Node *node_insert(Node *focus, View *);
+Node *node_remove(View *);
+Node *node_split(Node *leaf, NodeKind layout);
+void node_swap(Node *, Node *);
+Node *node_next_leaf(Node *);
+void node_set_weight(Node *, double);
+void node_for_each_view(Node *, void (*visit)(View *, void *data),
+    void *data);
+void node_arrange(Node *, Output *, struct wlr_box *);
@@ -0,0 +1,59 @@
+#include "bitter.h"
+#include <wlr/types/wlr_export_dmabuf_v1.h>
+#include <wlr/types/wlr_screencopy_v1.h>
+
+// Screen capture is served by wlroots from the frame we commit anyway:
+// screencopy reads the rendered buffer back during the commit, and
+// export-dmabuf hands out the buffer itself. All that's left for us is
+// to make sure the committed frame is one we rendered, and to count.
+
+void capture_init(Server *srv) {
+    srv->screencopy = wlr_screencopy_manager_v1_create(srv->display);
+    srv->export_dmabuf = wlr_export_dmabuf_manager_v1_create(srv->display);
+}
+
+// Whether the next commit has to be something we rendered; a client's
+// buffer scanned out directly isn't ours to read back or hand out.
+bool capture_pending(Output *out) {
+    struct wlr_screencopy_frame_v1 *copy;
+    wl_list_for_each (copy, &out->srv->screencopy->frames, link) {
+        if (copy->output == out->output)
+            return true;
+    }
+    struct wlr_export_dmabuf_frame_v1 *export;
+    wl_list_for_each (export, &out->srv->export_dmabuf->frames, link) {
+        if (export->output == out->output)
+            return true;
+    }
+    return false;
+}
+
+void capture_census(Output *out, bool damaged, CaptureCensus *census) {
+    *census = (CaptureCensus) {0};
+    struct wlr_screencopy_frame_v1 *copy;
+    wl_list_for_each (copy, &out->srv->screencopy->frames, link) {
+        // copies with damage wait for a frame that has some
+        if (copy->output != out->output || (copy->with_damage && !damaged))
+            continue;
+        if (copy->shm_buffer) {
+            census->shm++;
+            census->bytes += (uint64_t)copy->box.width * copy->box.height * 4;
+        } else if (copy->dma_buffer) {
+            census->dmabuf++;
+        }
+    }
+    struct wlr_export_dmabuf_frame_v1 *export;
+    wl_list_for_each (export, &out->srv->export_dmabuf->frames, link) {
+        if (export->output == out->output)
+            census->dmabuf++;
+    }
+}
+
+void capture_record(Output *out, CaptureCensus *census, int64_t usec) {
+    if (census->shm == 0 && census->dmabuf == 0)
+        return;
+    out->stats.capture.shm += census->shm;
+    out->stats.capture.dmabuf += census->dmabuf;
+    out->stats.capture.bytes += census->bytes;
+    out->stats.capture.usec += usec;
+}
@@ -0,0 +1,377 @@
+#include "bitter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <wlr/render/wlr_renderer.h>
+#include <wlr/render/wlr_texture.h>
+#include <wlr/util/log.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define COMPOSITE_X86
+#endif
+
+// Compositing on the CPU, for renderers that run there anyway. Tiled views
+// are unscaled and untransformed, so every surface is a plain rectangle of
+// pixels: damaged rows are copied or blended into a frame of our own, and
+// only the damaged part of that is uploaded, as a single texture drawn with
+// a single quad per rectangle instead of one per surface.
+//
+// wlroots releases SHM buffers as soon as they're uploaded, so the pixels
+// are copied out on commit.
+
+#define COMPOSITE_BACKGROUND 0xff008080
+
+static const CompositeKernels *kernels;
+
+static inline uint32_t div255(uint32_t x) {
+    x += 128;
+    return (x + (x >> 8)) >> 8;
+}
+
+static void copy_row_scalar(uint32_t *dst, const uint32_t *src, int len) {
+    for (int i = 0; i < len; i++)
+        dst[i] = src[i] | 0xff000000;
+}
+
+// Premultiplied source over destination.
+static void blend_row_scalar(uint32_t *dst, const uint32_t *src, int len) {
+    for (int i = 0; i < len; i++) {
+        uint32_t s = src[i];
+        if (s == 0)
+            continue;
+        uint32_t inv = 255 - (s >> 24), d = dst[i], out = 0;
+        for (int shift = 0; shift < 32; shift += 8) {
+            uint32_t c = div255(((d >> shift) & 0xff) * inv)
+                + ((s >> shift) & 0xff);
+            out |= (c > 255 ? 255 : c) << shift;
+        }
+        dst[i] = out;
+    }
+}
+
+#ifdef COMPOSITE_X86
+__attribute__((target("sse2")))
+static void copy_row_sse2(uint32_t *dst, const uint32_t *src, int len) {
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_or_si128(s, alpha));
+    }
+    copy_row_scalar(dst + i, src + i, len - i);
+}
+
+// Four pixels at a time, widened to 16 bits per channel: each destination
+// channel is scaled by its pixel's 255 - alpha, then the source is added.
+__attribute__((target("sse2")))
+static void blend_row_sse2(uint32_t *dst, const uint32_t *src, int len) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    const __m128i max = _mm_set1_epi32(255);
+    const __m128i half = _mm_set1_epi16(128);
+    int i = 0;
+    for (; i + 4 <= len; i += 4) {
+        __m128i s = _mm_loadu_si128((const __m128i *)(src + i));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(s, zero)) == 0xffff)
+            continue;
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(s, alpha),
+                alpha)) == 0xffff) {
+            _mm_storeu_si128((__m128i *)(dst + i), s);
+            continue;
+        }
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        __m128i inv = _mm_sub_epi32(max, _mm_srli_epi32(s, 24));
+        inv = _mm_or_si128(inv, _mm_slli_epi32(inv, 16));
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero),
+            _mm_unpacklo_epi32(inv, inv));
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero),
+            _mm_unpackhi_epi32(inv, inv));
+        lo = _mm_add_epi16(lo, half);
+        hi = _mm_add_epi16(hi, half);
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+        d = _mm_adds_epu8(_mm_packus_epi16(lo, hi), s);
+        _mm_storeu_si128((__m128i *)(dst + i), d);
+    }
+    blend_row_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void copy_row_avx2(uint32_t *dst, const uint32_t *src, int len) {
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_or_si256(s, alpha));
+    }
+    copy_row_scalar(dst + i, src + i, len - i);
+}
+
+// As for SSE2; the unpacks work within 128-bit lanes on both operands, so
+// pixels and their alphas still line up.
+__attribute__((target("avx2")))
+static void blend_row_avx2(uint32_t *dst, const uint32_t *src, int len) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    const __m256i max = _mm256_set1_epi32(255);
+    const __m256i half = _mm256_set1_epi16(128);
+    int i = 0;
+    for (; i + 8 <= len; i += 8) {
+        __m256i s = _mm256_loadu_si256((const __m256i *)(src + i));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(s, zero)) == -1)
+            continue;
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(
+                _mm256_and_si256(s, alpha), alpha)) == -1) {
+            _mm256_storeu_si256((__m256i *)(dst + i), s);
+            continue;
+        }
+        __m256i d = _mm256_loadu_si256((const __m256i *)(dst + i));
+        __m256i inv = _mm256_sub_epi32(max, _mm256_srli_epi32(s, 24));
+        inv = _mm256_or_si256(inv, _mm256_slli_epi32(inv, 16));
+        __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero),
+            _mm256_unpacklo_epi32(inv, inv));
+        __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero),
+            _mm256_unpackhi_epi32(inv, inv));
+        lo = _mm256_add_epi16(lo, half);
+        hi = _mm256_add_epi16(hi, half);
+        lo = _mm256_srli_epi16(_mm256_add_epi16(lo, _mm256_srli_epi16(lo, 8)),
+            8);
+        hi = _mm256_srli_epi16(_mm256_add_epi16(hi, _mm256_srli_epi16(hi, 8)),
+            8);
+        d = _mm256_adds_epu8(_mm256_packus_epi16(lo, hi), s);
+        _mm256_storeu_si256((__m256i *)(dst + i), d);
+    }
+    blend_row_sse2(dst + i, src + i, len - i);
+}
+#endif
+
+// Fastest first.
+const CompositeKernels composite_kernels[] = {
+#ifdef COMPOSITE_X86
+    { "avx2", "avx2", copy_row_avx2, blend_row_avx2 },
+    { "sse2", "sse2", copy_row_sse2, blend_row_sse2 },
+#endif
+    { "scalar", NULL, copy_row_scalar, blend_row_scalar },
+};
+
+const int composite_kernels_len =
+    sizeof(composite_kernels) / sizeof(composite_kernels[0]);
+
+bool composite_kernels_supported(const CompositeKernels *k) {
+#ifdef COMPOSITE_X86
+    // the builtin only takes literals
+    if (k->isa && strcmp(k->isa, "avx2") == 0)
+        return __builtin_cpu_supports("avx2");
+    if (k->isa && strcmp(k->isa, "sse2") == 0)
+        return __builtin_cpu_supports("sse2");
+#endif
+    return k->isa == NULL;
+}
+
+void composite_init(Server *srv) {
+    for (int i = 0; i < composite_kernels_len; i++) {
+        if (composite_kernels_supported(&composite_kernels[i])) {
+            kernels = &composite_kernels[i];
+            break;
+        }
+    }
+    wlr_log(WLR_INFO, "compositing on the CPU with %s", kernels->name);
+}
+
+static void composite_surface_drop(UploadTracker *tracker) {
+    if (tracker->cpu.pixels) {
+        account_remove(tracker->srv, tracker->client, AccountTexture,
+            (uint64_t)tracker->cpu.width * tracker->cpu.height * 4);
+    }
+    free(tracker->cpu.pixels);
+    tracker->cpu.pixels = NULL;
+    tracker->cpu.width = tracker->cpu.height = 0;
+}
+
+// Copies what the commit damaged out of the client's buffer.
+void composite_surface_commit(UploadTracker *tracker) {
+    struct wlr_surface *surface = tracker->surface;
+    if (!surface->buffer || !surface->buffer->resource) {
+        composite_surface_drop(tracker);
+        return;
+    }
+    struct wl_shm_buffer *shm = wl_shm_buffer_get(surface->buffer->resource);
+    uint32_t format = shm ? wl_shm_buffer_get_format(shm) : 0;
+    if (!shm || (format != WL_SHM_FORMAT_ARGB8888
+            && format != WL_SHM_FORMAT_XRGB8888)) {
+        composite_surface_drop(tracker);
+        return;
+    }
+    int width = wl_shm_buffer_get_width(shm);
+    int height = wl_shm_buffer_get_height(shm);
+    pixman_region32_t damage;
+    pixman_region32_init(&damage);
+    if (width != tracker->cpu.width || height != tracker->cpu.height) {
+        composite_surface_drop(tracker);
+        tracker->cpu.pixels = malloc((size_t)width * height * 4);
+        if (!tracker->cpu.pixels) {
+            pixman_region32_fini(&damage);
+            return;
+        }
+        tracker->cpu.width = width;
+        tracker->cpu.height = height;
+        account_add(tracker->srv, tracker->client, AccountTexture,
+            (uint64_t)width * height * 4);
+        pixman_region32_init_rect(&damage, 0, 0, width, height);
+    } else {
+        pixman_region32_intersect_rect(&damage, &surface->buffer_damage,
+            0, 0, width, height);
+    }
+    tracker->cpu.opaque = format == WL_SHM_FORMAT_XRGB8888;
+
+    int stride = wl_shm_buffer_get_stride(shm);
+    wl_shm_buffer_begin_access(shm);
+    const char *data = wl_shm_buffer_get_data(shm);
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(&damage, &nrects);
+    for (int i = 0; i < nrects; i++) {
+        size_t bytes = (size_t)(rects[i].x2 - rects[i].x1) * 4;
+        for (int y = rects[i].y1; y < rects[i].y2; y++) {
+            memcpy(tracker->cpu.pixels + (size_t)y * width + rects[i].x1,
+                data + (size_t)y * stride + rects[i].x1 * 4, bytes);
+        }
+    }
+    wl_shm_buffer_end_access(shm);
+    pixman_region32_fini(&damage);
+}
+
+void composite_surface_finish(UploadTracker *tracker) {
+    composite_surface_drop(tracker);
+}
+
+static bool composite_output_resize(Output *out, int width, int height) {
+    if (out->cpu.pixels && out->cpu.width == width
+        && out->cpu.height == height)
+        return true;
+    composite_output_finish(out);
+    out->cpu.pixels = malloc((size_t)width * height * 4);
+    if (!out->cpu.pixels)
+        return false;
+    out->cpu.width = width;
+    out->cpu.height = height;
+    out->cpu.texture = wlr_texture_from_pixels(out->srv->renderer,
+        WL_SHM_FORMAT_XRGB8888, width * 4, width, height, out->cpu.pixels);
+    if (!out->cpu.texture) {
+        composite_output_finish(out);
+        return false;
+    }
+    return true;
+}
+
+static void composite_region(Output *out, UploadTracker *tracker,
+    struct wlr_box *box, pixman_region32_t *region, bool blend)
+{
+    void (*row)(uint32_t *, const uint32_t *, int) =
+        blend ? kernels->blend : kernels->copy;
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(region, &nrects);
+    for (int i = 0; i < nrects; i++) {
+        int len = rects[i].x2 - rects[i].x1;
+        for (int y = rects[i].y1; y < rects[i].y2; y++) {
+            row(out->cpu.pixels + (size_t)y * out->cpu.width + rects[i].x1,
+                tracker->cpu.pixels + (size_t)(y - box->y) * tracker->cpu.width
+                    + rects[i].x1 - box->x,
+                len);
+        }
+    }
+}
+
+static void composite_fill(Output *out, pixman_region32_t *region) {
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(region, &nrects);
+    for (int i = 0; i < nrects; i++) {
+        for (int y = rects[i].y1; y < rects[i].y2; y++) {
+            uint32_t *row = out->cpu.pixels + (size_t)y * out->cpu.width;
+            for (int x = rects[i].x1; x < rects[i].x2; x++)
+                row[x] = COMPOSITE_BACKGROUND;
+        }
+    }
+}
+
+// Brings the frame up to date where damaged and returns the texture it's
+// in, or NULL if something on screen can't be composited here, in which
+// case the caller draws it the usual way.
+struct wlr_texture *composite_frame(Output *out, pixman_region32_t *damage,
+    pixman_region32_t *opaque, int *drawn)
+{
+    struct wlr_output *output = out->output;
+    if (output->transform != WL_OUTPUT_TRANSFORM_NORMAL
+        || output->scale != 1.0f)
+        goto fallback;
+    RenderItem *item;
+    wl_array_for_each (item, &out->render_items) {
+        UploadTracker *tracker = upload_tracker_from_surface(item->surface);
+        struct wlr_box *box = &item->scene->buffer_box;
+        if (!tracker || !tracker->cpu.pixels
+            || tracker->cpu.width != box->width
+            || tracker->cpu.height != box->height
+            || item->surface->current.transform != WL_OUTPUT_TRANSFORM_NORMAL)
+            goto fallback;
+    }
+    int width, height;
+    wlr_output_transformed_resolution(output, &width, &height);
+    if (!composite_output_resize(out, width, height))
+        goto fallback;
+
+    pixman_region32_t paint, region;
+    pixman_region32_init(&region);
+    pixman_region32_init_rect(&paint, 0, 0, width, height);
+    // what was drawn some other way last time has to be caught up on
+    if (out->cpu.valid)
+        pixman_region32_intersect(&paint, &paint, damage);
+
+    pixman_region32_subtract(&region, &paint, opaque);
+    composite_fill(out, &region);
+    wl_array_for_each (item, &out->render_items) {
+        UploadTracker *tracker = upload_tracker_from_surface(item->surface);
+        struct wlr_box *box = &item->scene->buffer_box;
+        pixman_region32_intersect(&region, &item->visible, &paint);
+        if (!pixman_region32_not_empty(&region))
+            continue;
+        (*drawn)++;
+        if (tracker->cpu.opaque) {
+            composite_region(out, tracker, box, &region, false);
+            continue;
+        }
+        // what the client promised is opaque can skip blending
+        pixman_region32_t blend;
+        pixman_region32_init(&blend);
+        pixman_region32_subtract(&blend, &region, &item->scene->opaque);
+        pixman_region32_intersect(&region, &region, &item->scene->opaque);
+        composite_region(out, tracker, box, &region, false);
+        composite_region(out, tracker, box, &blend, true);
+        pixman_region32_fini(&blend);
+    }
+
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(&paint, &nrects);
+    for (int i = 0; i < nrects; i++) {
+        int w = rects[i].x2 - rects[i].x1, h = rects[i].y2 - rects[i].y1;
+        wlr_texture_write_pixels(out->cpu.texture, width * 4, w, h,
+            rects[i].x1, rects[i].y1, rects[i].x1, rects[i].y1,
+            out->cpu.pixels);
+        out->srv->upload_bytes += (uint64_t)w * h * 4;
+    }
+    pixman_region32_fini(&region);
+    pixman_region32_fini(&paint);
+    out->cpu.valid = true;
+    return out->cpu.texture;
+
+fallback:
+    out->cpu.valid = false;
+    return NULL;
+}
+
+void composite_output_finish(Output *out) {
+    if (out->cpu.texture)
+        wlr_texture_destroy(out->cpu.texture);
+    free(out->cpu.pixels);
+    out->cpu.pixels = NULL;
+    out->cpu.texture = NULL;
+    out->cpu.width = out->cpu.height = 0;
+    out->cpu.valid = false;
+}
@@ -0,0 +1,71 @@
+#include "bitter.h"
+#include <pthread.h>
+#include <unistd.h>
+#include <wlr/types/wlr_cursor.h>
+#include <wlr/types/wlr_xcursor_manager.h>
+#include <wlr/util/log.h>
+
+// Reading a cursor theme means opening and decoding dozens of files, so it
+// happens on a thread while the backend comes up. The manager isn't shared
+// until the thread is joined; until then the cursor just isn't drawn.
+
+static void *cursor_theme_thread(void *data) {
+    Server *srv = data;
+    wlr_xcursor_manager_load(srv->cursor_theme.loading, 1);
+    char done = 1;
+    if (write(srv->cursor_theme.fds[1], &done, 1) < 0) {
+        // joined on shutdown regardless
+    }
+    return NULL;
+}
+
+static void cursor_theme_join(Server *srv) {
+    if (!srv->cursor_theme.running)
+        return;
+    pthread_join(srv->cursor_theme.thread, NULL);
+    srv->cursor_theme.running = false;
+    wl_event_source_remove(srv->cursor_theme.source);
+    close(srv->cursor_theme.fds[0]);
+    close(srv->cursor_theme.fds[1]);
+    srv->xcursor_manager = srv->cursor_theme.loading;
+    srv->cursor_theme.loading = NULL;
+    startup_mark(srv, "cursor theme");
+    // show whatever the pointer should have looked like meanwhile
+    const char *image = srv->cursor_image;
+    srv->cursor_image = NULL;
+    if (image)
+        server_set_cursor_image(srv, image);
+}
+
+static int cursor_theme_on_done(int fd, uint32_t mask, void *data) {
+    cursor_theme_join(data);
+    return 0;
+}
+
+void cursor_theme_init(Server *srv) {
+    struct wlr_xcursor_manager *manager = wlr_xcursor_manager_create(NULL, 24);
+    if (pipe(srv->cursor_theme.fds) < 0)
+        goto sync;
+    srv->cursor_theme.loading = manager;
+    srv->cursor_theme.source = wl_event_loop_add_fd(
+        wl_display_get_event_loop(srv->display), srv->cursor_theme.fds[0],
+        WL_EVENT_READABLE, cursor_theme_on_done, srv);
+    if (pthread_create(&srv->cursor_theme.thread, NULL,
+            cursor_theme_thread, srv) == 0) {
+        srv->cursor_theme.running = true;
+        return;
+    }
+    wl_event_source_remove(srv->cursor_theme.source);
+    close(srv->cursor_theme.fds[0]);
+    close(srv->cursor_theme.fds[1]);
+    srv->cursor_theme.loading = NULL;
+sync:
+    wlr_log(WLR_ERROR, "loading the cursor theme on the main thread");
+    wlr_xcursor_manager_load(manager, 1);
+    srv->xcursor_manager = manager;
+}
+
+void cursor_theme_finish(Server *srv) {
+    cursor_theme_join(srv);
+    wlr_xcursor_manager_destroy(srv->xcursor_manager);
+}
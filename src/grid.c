@@ -0,0 +1,81 @@
+#include "bitter.h"
+
+void grid_init(ViewGrid *grid) {
+    *grid = (ViewGrid) {
+        .dirty = true,
+    };
+    for (int i = 0; i < GRID_CELLS * GRID_CELLS; i++)
+        wl_array_init(&grid->cells[i]);
+}
+
+void grid_finish(ViewGrid *grid) {
+    for (int i = 0; i < GRID_CELLS * GRID_CELLS; i++)
+        wl_array_release(&grid->cells[i]);
+}
+
+static int int_clamp(int value, int min, int max) {
+    return value < min ? min : value > max ? max : value;
+}
+
+static int grid_column(ViewGrid *grid, int x) {
+    return int_clamp((x - grid->box.x) / grid->cell_width, 0, GRID_CELLS - 1);
+}
+
+static int grid_row(ViewGrid *grid, int y) {
+    return int_clamp((y - grid->box.y) / grid->cell_height, 0, GRID_CELLS - 1);
+}
+
+static void grid_insert_view(View *view, void *data) {
+    ViewGrid *grid = data;
+    struct wlr_box bounds;
+    if (!wlr_box_intersection(&bounds, &view->bounds, &grid->box))
+        return;
+    int x1 = grid_column(grid, bounds.x);
+    int x2 = grid_column(grid, bounds.x + bounds.width - 1);
+    int y1 = grid_row(grid, bounds.y);
+    int y2 = grid_row(grid, bounds.y + bounds.height - 1);
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            View **slot = wl_array_add(&grid->cells[y * GRID_CELLS + x],
+                sizeof(View *));
+            if (slot)
+                *slot = view;
+        }
+    }
+}
+
+void grid_rebuild(ViewGrid *grid, Node *root, struct wlr_box *box) {
+    for (int i = 0; i < GRID_CELLS * GRID_CELLS; i++)
+        grid->cells[i].size = 0;
+    grid->box = *box;
+    grid->cell_width = (box->width + GRID_CELLS - 1) / GRID_CELLS;
+    grid->cell_height = (box->height + GRID_CELLS - 1) / GRID_CELLS;
+    if (grid->cell_width < 1)
+        grid->cell_width = 1;
+    if (grid->cell_height < 1)
+        grid->cell_height = 1;
+    node_for_each_view(root, grid_insert_view, grid);
+    grid->dirty = false;
+}
+
+View *grid_view_at(ViewGrid *grid, double x, double y,
+    struct wlr_surface **surface, double *sx, double *sy)
+{
+    if (!wlr_box_contains_point(&grid->box, x, y))
+        return NULL;
+    struct wl_array *cell =
+        &grid->cells[grid_row(grid, y) * GRID_CELLS + grid_column(grid, x)];
+    View **views = cell->data;
+    // later views are stacked on top
+    for (size_t i = cell->size / sizeof(View *); i-- > 0;) {
+        View *view = views[i];
+        if (!wlr_box_contains_point(&view->bounds, x, y))
+            continue;
+        int ox, oy;
+        view_get_origin(view, &ox, &oy);
+        *surface = view_surface_at(view, x - ox, y - oy, sx, sy);
+        if (*surface)
+            return view;
+    }
+    return NULL;
+}
@@ -0,0 +1,446 @@
+#include "bitter.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <wlr/types/wlr_output_layout.h>
+#include <wlr/util/log.h>
+
+// A control socket for bars and scripts. Requests are read straight into
+// the client's buffer and handled where they lie. Replies and events are
+// queued and written once at the end of the dispatch, and an event that
+// fires several times in a dispatch is only sent once, encoded once for
+// every subscriber.
+
+static void ipc_schedule_flush(Server *srv);
+
+static bool ipc_set_flags(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0
+        && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+static void ipc_client_destroy(IpcClient *c) {
+    wl_event_source_remove(c->source);
+    close(c->fd);
+    wl_list_remove(&c->link);
+    wl_array_release(&c->out);
+    free(c);
+}
+
+static void ipc_client_send(IpcClient *c, uint32_t type, const void *payload,
+    size_t len)
+{
+    IpcHeader header = {
+        .length = len,
+        .type = type,
+    };
+    char *dst = wl_array_add(&c->out, sizeof(header) + len);
+    if (!dst)
+        return;
+    memcpy(dst, &header, sizeof(header));
+    if (len > 0)
+        memcpy(dst + sizeof(header), payload, len);
+    ipc_schedule_flush(c->srv);
+}
+
+static void ipc_client_send_status(IpcClient *c, uint32_t type,
+    uint32_t status)
+{
+    ipc_client_send(c, type, &status, sizeof(status));
+}
+
+// Returns false if the client should be dropped.
+static bool ipc_client_flush(IpcClient *c) {
+    while (c->out_pos < c->out.size) {
+        ssize_t n = send(c->fd, (char *)c->out.data + c->out_pos,
+            c->out.size - c->out_pos, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            return false;
+        c->out_pos += n;
+    }
+    size_t left = c->out.size - c->out_pos;
+    if (left > IPC_MAX_BACKLOG) {
+        wlr_log(WLR_INFO, "dropping an IPC client that stopped reading");
+        return false;
+    }
+    if (c->out_pos > 0) {
+        memmove(c->out.data, (char *)c->out.data + c->out_pos, left);
+        c->out.size = left;
+        c->out_pos = 0;
+    }
+    uint32_t mask = WL_EVENT_READABLE | (left > 0 ? WL_EVENT_WRITABLE : 0);
+    if (mask != c->mask) {
+        wl_event_source_fd_update(c->source, mask);
+        c->mask = mask;
+    }
+    return true;
+}
+
+static void ipc_write_node(struct wl_array *buf, Node *n, Node *focused,
+    uint32_t *count)
+{
+    IpcNodeRecord *rec = wl_array_add(buf, sizeof(*rec));
+    if (!rec)
+        return;
+    *rec = (IpcNodeRecord) {
+        .kind = n->kind,
+        .focused = n == focused,
+        .x = n->box.x,
+        .y = n->box.y,
+        .width = n->box.width,
+        .height = n->box.height,
+        .weight = n->weight,
+    };
+    (*count)++;
+    if (n->kind == NodeLeaf) {
+        rec->view = n->view ? n->view->id : 0;
+        return;
+    }
+    // the array may move once children are added
+    rec->children = n->len;
+    Node *child;
+    wl_list_for_each (child, &n->children, link) {
+        ipc_write_node(buf, child, focused, count);
+    }
+}
+
+static void ipc_write_outputs(Server *srv, struct wl_array *buf,
+    bool with_tree)
+{
+    Output *out;
+    wl_list_for_each_reverse (out, &srv->outputs, link) {
+        size_t offset = buf->size;
+        IpcOutputRecord *rec = wl_array_add(buf, sizeof(*rec));
+        if (!rec)
+            return;
+        struct wlr_box *box = wlr_output_layout_get_box(srv->output_layout,
+            out->output);
+        *rec = (IpcOutputRecord) {
+            .refresh = out->output->refresh,
+            .scale = out->output->scale,
+            .adaptive_sync = out->output->adaptive_sync_status
+                == WLR_OUTPUT_ADAPTIVE_SYNC_ENABLED,
+        };
+        snprintf(rec->name, sizeof(rec->name), "%s", out->output->name);
+        if (box) {
+            rec->x = box->x;
+            rec->y = box->y;
+            rec->width = box->width;
+            rec->height = box->height;
+        }
+        if (!with_tree || !out->root)
+            continue;
+        uint32_t nodes = 0;
+        ipc_write_node(buf, out->root, srv->focused, &nodes);
+        rec = (IpcOutputRecord *)((char *)buf->data + offset);
+        rec->nodes = nodes;
+    }
+}
+
+typedef struct IpcFind {
+    uint32_t id;
+    View *view;
+} IpcFind;
+
+static void ipc_find_visit(View *view, void *data) {
+    IpcFind *find = data;
+    if (view->id == find->id)
+        find->view = view;
+}
+
+static View *ipc_find_view(Server *srv, uint32_t id) {
+    IpcFind find = { .id = id };
+    Output *out;
+    wl_list_for_each (out, &srv->outputs, link) {
+        if (out->root)
+            node_for_each_view(out->root, ipc_find_visit, &find);
+        if (find.view)
+            return find.view;
+    }
+    return NULL;
+}
+
+static void ipc_command(IpcClient *c, const uint8_t *payload, size_t len) {
+    Server *srv = c->srv;
+    IpcCommandRequest req;
+    if (len < sizeof(req)) {
+        ipc_client_send_status(c, IpcError, IpcCommand);
+        return;
+    }
+    memcpy(&req, payload, sizeof(req));
+    // the argument is used where it lies, it only has to be terminated
+    const char *arg = NULL;
+    if (len > sizeof(req)) {
+        arg = (const char *)payload + sizeof(req);
+        if (!memchr(arg, '\0', len - sizeof(req))) {
+            ipc_client_send_status(c, IpcCommand, EINVAL);
+            return;
+        }
+    }
+    if (req.action >= BINDING_ACTIONS) {
+        ipc_client_send_status(c, IpcCommand, EINVAL);
+        return;
+    }
+    if (req.view) {
+        View *view = ipc_find_view(srv, req.view);
+        if (!view) {
+            ipc_client_send_status(c, IpcCommand, ENOENT);
+            return;
+        }
+        srv->focused = view->tiled.node;
+        ipc_notify(srv, IPC_EVENT(IpcEventFocus));
+    }
+    binding_run(srv, req.action, arg);
+    ipc_client_send_status(c, IpcCommand, 0);
+}
+
+static void ipc_handle(IpcClient *c, uint32_t type, const uint8_t *payload,
+    size_t len)
+{
+    Server *srv = c->srv;
+    switch (type) {
+        case IpcGetTree:
+        case IpcGetOutputs: {
+            srv->ipc.scratch.size = 0;
+            ipc_write_outputs(srv, &srv->ipc.scratch, type == IpcGetTree);
+            ipc_client_send(c, type, srv->ipc.scratch.data,
+                srv->ipc.scratch.size);
+            break;
+        }
+        case IpcCommand: {
+            ipc_command(c, payload, len);
+            break;
+        }
+        case IpcSubscribe: {
+            uint32_t events;
+            if (len != sizeof(events)) {
+                ipc_client_send_status(c, IpcError, type);
+                break;
+            }
+            memcpy(&events, payload, sizeof(events));
+            c->events = events & IPC_EVENTS;
+            ipc_client_send_status(c, type, events == c->events ? 0 : EINVAL);
+            break;
+        }
+        default: {
+            ipc_client_send_status(c, IpcError, type);
+            break;
+        }
+    }
+}
+
+// Handles every complete request in the buffer. Returns false on garbage.
+static bool ipc_client_parse(IpcClient *c) {
+    size_t pos = 0;
+    while (c->in_len - pos >= sizeof(IpcHeader)) {
+        IpcHeader header;
+        memcpy(&header, c->in + pos, sizeof(header));
+        if (header.length > IPC_BUFFER_SIZE - sizeof(header))
+            return false;
+        if (c->in_len - pos - sizeof(header) < header.length)
+            break;
+        ipc_handle(c, header.type, c->in + pos + sizeof(header),
+            header.length);
+        pos += sizeof(header) + header.length;
+    }
+    if (pos > 0) {
+        memmove(c->in, c->in + pos, c->in_len - pos);
+        c->in_len -= pos;
+    }
+    return true;
+}
+
+static bool ipc_client_read(IpcClient *c) {
+    for (;;) {
+        size_t space = sizeof(c->in) - c->in_len;
+        ssize_t n = read(c->fd, c->in + c->in_len, space);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && errno == EAGAIN)
+            return true;
+        if (n <= 0)
+            return false;
+        c->in_len += n;
+        if (!ipc_client_parse(c))
+            return false;
+        if ((size_t)n < space)
+            return true;
+    }
+}
+
+static int ipc_client_on_event(int fd, uint32_t mask, void *data) {
+    IpcClient *c = data;
+    bool ok = !(mask & WL_EVENT_ERROR);
+    if (ok && (mask & WL_EVENT_READABLE))
+        ok = ipc_client_read(c);
+    else if (ok && (mask & WL_EVENT_HANGUP))
+        ok = false;
+    if (ok && (mask & WL_EVENT_WRITABLE))
+        ok = ipc_client_flush(c);
+    if (!ok)
+        ipc_client_destroy(c);
+    return 0;
+}
+
+static int ipc_on_connect(int fd, uint32_t mask, void *data) {
+    Server *srv = data;
+    int client_fd;
+    while ((client_fd = accept(fd, NULL, NULL)) >= 0) {
+        IpcClient *c = malloc(sizeof(IpcClient));
+        if (!c || !ipc_set_flags(client_fd)) {
+            free(c);
+            close(client_fd);
+            continue;
+        }
+        c->srv = srv;
+        c->fd = client_fd;
+        c->mask = WL_EVENT_READABLE;
+        c->events = 0;
+        c->in_len = 0;
+        c->out_pos = 0;
+        wl_array_init(&c->out);
+        c->source = wl_event_loop_add_fd(
+            wl_display_get_event_loop(srv->display), client_fd, c->mask,
+            ipc_client_on_event, c);
+        wl_list_insert(&srv->ipc.clients, &c->link);
+    }
+    return 0;
+}
+
+static void ipc_broadcast(Server *srv, uint32_t type) {
+    IpcClient *c;
+    wl_list_for_each (c, &srv->ipc.clients, link) {
+        if (c->events & IPC_EVENT(type)) {
+            ipc_client_send(c, type, srv->ipc.scratch.data,
+                srv->ipc.scratch.size);
+        }
+    }
+}
+
+// Encodes each pending event once, for everyone subscribed to it.
+static void ipc_send_events(Server *srv) {
+    uint32_t wanted = 0;
+    IpcClient *c;
+    wl_list_for_each (c, &srv->ipc.clients, link) {
+        wanted |= c->events;
+    }
+    uint32_t events = srv->ipc.events & wanted;
+    srv->ipc.events = 0;
+
+    if (events & IPC_EVENT(IpcEventOutputs)) {
+        srv->ipc.scratch.size = 0;
+        ipc_write_outputs(srv, &srv->ipc.scratch, false);
+        ipc_broadcast(srv, IpcEventOutputs);
+    }
+    if (events & IPC_EVENT(IpcEventLayout)) {
+        srv->ipc.scratch.size = 0;
+        ipc_write_outputs(srv, &srv->ipc.scratch, true);
+        ipc_broadcast(srv, IpcEventLayout);
+    }
+    Node *focused = srv->focused;
+    uint32_t view = focused && focused->kind == NodeLeaf && focused->view
+        ? focused->view->id : 0;
+    if (view != srv->ipc.focused_view) {
+        srv->ipc.focused_view = view;
+        if (wanted & IPC_EVENT(IpcEventFocus)) {
+            srv->ipc.scratch.size = 0;
+            uint32_t *id = wl_array_add(&srv->ipc.scratch, sizeof(*id));
+            if (id) {
+                *id = view;
+                ipc_broadcast(srv, IpcEventFocus);
+            }
+        }
+    }
+}
+
+static void ipc_on_flush_idle(void *data) {
+    Server *srv = data;
+    // still set while sending, so queueing doesn't schedule another flush
+    ipc_send_events(srv);
+    IpcClient *c, *tmp;
+    wl_list_for_each_safe (c, tmp, &srv->ipc.clients, link) {
+        if (!ipc_client_flush(c))
+            ipc_client_destroy(c);
+    }
+    srv->ipc.flush_idle = NULL;
+}
+
+static void ipc_schedule_flush(Server *srv) {
+    if (srv->ipc.flush_idle)
+        return;
+    srv->ipc.flush_idle = wl_event_loop_add_idle(
+        wl_display_get_event_loop(srv->display), ipc_on_flush_idle, srv);
+}
+
+// Marks events as having happened; they go out once the dispatch is over.
+void ipc_notify(Server *srv, uint32_t events) {
+    if (wl_list_empty(&srv->ipc.clients))
+        return;
+    srv->ipc.events |= events;
+    ipc_schedule_flush(srv);
+}
+
+// Listens next to the Wayland socket, and tells children where.
+void ipc_init(Server *srv) {
+    wl_list_init(&srv->ipc.clients);
+    wl_array_init(&srv->ipc.scratch);
+    srv->ipc.fd = -1;
+    const char *dir = getenv("XDG_RUNTIME_DIR");
+    if (!dir || !srv->socket) {
+        wlr_log(WLR_ERROR, "no XDG_RUNTIME_DIR, not listening for IPC");
+        return;
+    }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int len = snprintf(addr.sun_path, sizeof(addr.sun_path),
+        "%s/bitter.%s.sock", dir, srv->socket);
+    if (len < 0 || len >= (int)sizeof(addr.sun_path)) {
+        wlr_log(WLR_ERROR, "IPC socket path too long");
+        return;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || !ipc_set_flags(fd)) {
+        wlr_log_errno(WLR_ERROR, "creating the IPC socket");
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    // the Wayland socket's lock is ours, so anything here is stale
+    unlink(addr.sun_path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || listen(fd, 16) < 0) {
+        wlr_log_errno(WLR_ERROR, "binding %s", addr.sun_path);
+        close(fd);
+        return;
+    }
+    srv->ipc.fd = fd;
+    srv->ipc.path = strdup(addr.sun_path);
+    srv->ipc.source = wl_event_loop_add_fd(
+        wl_display_get_event_loop(srv->display), fd, WL_EVENT_READABLE,
+        ipc_on_connect, srv);
+    setenv("BITTER_IPC_SOCKET", addr.sun_path, true);
+}
+
+void ipc_finish(Server *srv) {
+    IpcClient *c, *tmp;
+    wl_list_for_each_safe (c, tmp, &srv->ipc.clients, link) {
+        ipc_client_destroy(c);
+    }
+    if (srv->ipc.flush_idle)
+        wl_event_source_remove(srv->ipc.flush_idle);
+    if (srv->ipc.fd >= 0) {
+        wl_event_source_remove(srv->ipc.source);
+        close(srv->ipc.fd);
+        unlink(srv->ipc.path);
+        free(srv->ipc.path);
+    }
+    wl_array_release(&srv->ipc.scratch);
+}
@@ -6,17 +6,11 @@
 #include <xkbcommon/xkbcommon.h>
 
 Keyboard *keyboard_create(Server *srv, struct wlr_input_device *device) {
-    Keyboard *kb = malloc(sizeof(Keyboard));
+    Keyboard *kb = pool_alloc(&keyboard_pool);
 
-    struct xkb_rule_names rules = {
-        .layout = "us",
-        .variant = "colemak",
-    };
-    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-    struct xkb_keymap *keymap = xkb_map_new_from_names(context, &rules, XKB_KEYMAP_COMPILE_NO_FLAGS);
-    wlr_keyboard_set_keymap(device->keyboard, keymap);
-    xkb_keymap_unref(keymap);
-    xkb_context_unref(context);
+    struct xkb_keymap *keymap = keymap_get(srv, &srv->xkb_rules);
+    if (keymap)
+        wlr_keyboard_set_keymap(device->keyboard, keymap);
     wlr_keyboard_set_repeat_info(device->keyboard, 50, 180);
 
     *kb = (Keyboard) {
@@ -33,23 +27,71 @@ Keyboard *keyboard_create(Server *srv, struct wlr_input_device *device) {
     return kb;
 }
 
+// Only switches the seat's keyboard when another one was last used.
+static void keyboard_activate(Keyboard *kb) {
+    if (wlr_seat_get_keyboard(kb->srv->seat) != kb->device->keyboard)
+        wlr_seat_set_keyboard(kb->srv->seat, kb->device);
+}
+
+// Modifier changes are sent once per dispatch, or just before the next key
+// so clients always see them in order.
+static void keyboard_flush_modifiers(Keyboard *kb) {
+    if (!kb->modifiers_pending)
+        return;
+    kb->modifiers_pending = false;
+    keyboard_activate(kb);
+    wlr_seat_keyboard_notify_modifiers(kb->srv->seat,
+        &kb->device->keyboard->modifiers);
+}
+
+static void keyboard_on_modifiers_idle(void *data) {
+    Keyboard *kb = data;
+    kb->modifiers_idle = NULL;
+    keyboard_flush_modifiers(kb);
+}
+
+static bool keyboard_take_consumed(Keyboard *kb, uint32_t keycode) {
+    if (keycode >= KEYBOARD_KEYCODES)
+        return false;
+    uint8_t bit = 1 << (keycode % 8);
+    bool consumed = kb->consumed[keycode / 8] & bit;
+    kb->consumed[keycode / 8] &= ~bit;
+    return consumed;
+}
+
 void keyboard_key(Keyboard *kb, struct wlr_event_keyboard_key *event) {
     uint32_t keycode = event->keycode + 8;
-    wlr_seat_set_keyboard(kb->srv->seat, kb->device);
+    if (event->state == WL_KEYBOARD_KEY_STATE_PRESSED
+        && binding_handle(kb->srv, kb->device->keyboard, keycode))
+    {
+        if (event->keycode < KEYBOARD_KEYCODES)
+            kb->consumed[event->keycode / 8] |= 1 << (event->keycode % 8);
+        return;
+    }
+    if (event->state == WL_KEYBOARD_KEY_STATE_RELEASED
+        && keyboard_take_consumed(kb, event->keycode))
+        return;
+    keyboard_flush_modifiers(kb);
+    keyboard_activate(kb);
     wlr_seat_keyboard_notify_key(kb->srv->seat, event->time_msec,
         event->keycode, event->state);
 }
 
 void keyboard_modifiers(Keyboard *kb, void *data) {
-    wlr_seat_set_keyboard(kb->srv->seat, kb->device);
-    wlr_seat_keyboard_notify_modifiers(kb->srv->seat,
-        &kb->device->keyboard->modifiers);
+    kb->modifiers_pending = true;
+    if (!kb->modifiers_idle) {
+        kb->modifiers_idle = wl_event_loop_add_idle(
+            wl_display_get_event_loop(kb->srv->display),
+            keyboard_on_modifiers_idle, kb);
+    }
 }
 
 void keyboard_destroy(Keyboard *kb, void *data) {
+    if (kb->modifiers_idle)
+        wl_event_source_remove(kb->modifiers_idle);
     wl_list_remove(&kb->on_key.link);
     wl_list_remove(&kb->on_modifiers.link);
     wl_list_remove(&kb->on_destroy.link);
     wl_list_remove(&kb->link);
-    free(kb);
+    pool_free(&keyboard_pool, kb);
 }
@@ -0,0 +1,154 @@
+#include "bitter.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <wlr/util/log.h>
+#include <xkbcommon/xkbcommon.h>
+
+// Compiling a keymap takes tens of milliseconds, so every keyboard with the
+// same rule names shares one compiled keymap, and the configured one is
+// compiled on a thread while the backend starts.
+
+static char *strdup_or_null(const char *str) {
+    return str ? strdup(str) : NULL;
+}
+
+static bool str_equal(const char *a, const char *b) {
+    return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static bool rules_equal(const struct xkb_rule_names *a,
+    const struct xkb_rule_names *b)
+{
+    return str_equal(a->rules, b->rules)
+        && str_equal(a->model, b->model)
+        && str_equal(a->layout, b->layout)
+        && str_equal(a->variant, b->variant)
+        && str_equal(a->options, b->options);
+}
+
+static void keymap_insert(Server *srv, const struct xkb_rule_names *rules,
+    struct xkb_keymap *keymap)
+{
+    Keymap *km = malloc(sizeof(Keymap));
+    *km = (Keymap) {
+        .rules = {
+            .rules = strdup_or_null(rules->rules),
+            .model = strdup_or_null(rules->model),
+            .layout = strdup_or_null(rules->layout),
+            .variant = strdup_or_null(rules->variant),
+            .options = strdup_or_null(rules->options),
+        },
+        .keymap = keymap,
+    };
+    wl_list_insert(&srv->keymaps, &km->link);
+}
+
+static void keymap_destroy(Keymap *km) {
+    xkb_keymap_unref(km->keymap);
+    free((char *)km->rules.rules);
+    free((char *)km->rules.model);
+    free((char *)km->rules.layout);
+    free((char *)km->rules.variant);
+    free((char *)km->rules.options);
+    wl_list_remove(&km->link);
+    free(km);
+}
+
+// xkb contexts aren't thread safe, so the thread gets its own; the keymap
+// only changes hands after the thread has been joined.
+static void *keymap_precompile_thread(void *data) {
+    Server *srv = data;
+    struct xkb_context *context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    if (context) {
+        srv->precompile.keymap = xkb_keymap_new_from_names(context,
+            &srv->xkb_rules, XKB_KEYMAP_COMPILE_NO_FLAGS);
+        xkb_context_unref(context);
+    }
+    char done = 1;
+    if (write(srv->precompile.fds[1], &done, 1) < 0) {
+        // the main thread joins on its own when it next needs a keymap
+    }
+    return NULL;
+}
+
+static void keymap_precompile_join(Server *srv) {
+    if (!srv->precompile.running)
+        return;
+    pthread_join(srv->precompile.thread, NULL);
+    srv->precompile.running = false;
+    wl_event_source_remove(srv->precompile.source);
+    close(srv->precompile.fds[0]);
+    close(srv->precompile.fds[1]);
+    if (srv->precompile.keymap)
+        keymap_insert(srv, &srv->xkb_rules, srv->precompile.keymap);
+    else
+        wlr_log(WLR_ERROR, "failed to compile keymap");
+    srv->precompile.keymap = NULL;
+}
+
+static int keymap_on_precompile_done(int fd, uint32_t mask, void *data) {
+    keymap_precompile_join(data);
+    return 0;
+}
+
+void keymap_init(Server *srv) {
+    const char *layout = getenv("XKB_DEFAULT_LAYOUT");
+    srv->xkb_rules = (struct xkb_rule_names) {
+        .rules = strdup_or_null(getenv("XKB_DEFAULT_RULES")),
+        .model = strdup_or_null(getenv("XKB_DEFAULT_MODEL")),
+        .layout = strdup_or_null(layout ? layout : "us"),
+        .variant = strdup_or_null(layout
+            ? getenv("XKB_DEFAULT_VARIANT") : "colemak"),
+        .options = strdup_or_null(getenv("XKB_DEFAULT_OPTIONS")),
+    };
+    srv->xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+    wl_list_init(&srv->keymaps);
+
+    if (pipe(srv->precompile.fds) < 0)
+        return;
+    srv->precompile.source = wl_event_loop_add_fd(
+        wl_display_get_event_loop(srv->display), srv->precompile.fds[0],
+        WL_EVENT_READABLE, keymap_on_precompile_done, srv);
+    if (pthread_create(&srv->precompile.thread, NULL,
+            keymap_precompile_thread, srv) != 0) {
+        wl_event_source_remove(srv->precompile.source);
+        close(srv->precompile.fds[0]);
+        close(srv->precompile.fds[1]);
+        return;
+    }
+    srv->precompile.running = true;
+}
+
+void keymap_finish(Server *srv) {
+    keymap_precompile_join(srv);
+    Keymap *km, *tmp;
+    wl_list_for_each_safe (km, tmp, &srv->keymaps, link) {
+        keymap_destroy(km);
+    }
+    xkb_context_unref(srv->xkb_context);
+    free((char *)srv->xkb_rules.rules);
+    free((char *)srv->xkb_rules.model);
+    free((char *)srv->xkb_rules.layout);
+    free((char *)srv->xkb_rules.variant);
+    free((char *)srv->xkb_rules.options);
+}
+
+// Returns a keymap owned by the cache, compiling it if nobody has asked for
+// these rules yet.
+struct xkb_keymap *keymap_get(Server *srv, const struct xkb_rule_names *rules) {
+    // waiting for the precompile beats compiling the same keymap twice
+    keymap_precompile_join(srv);
+    Keymap *km;
+    wl_list_for_each (km, &srv->keymaps, link) {
+        if (rules_equal(&km->rules, rules))
+            return km->keymap;
+    }
+    struct xkb_keymap *keymap = xkb_keymap_new_from_names(srv->xkb_context,
+        rules, XKB_KEYMAP_COMPILE_NO_FLAGS);
+    if (!keymap)
+        return NULL;
+    keymap_insert(srv, rules, keymap);
+    return keymap;
+}
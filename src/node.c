@@ -1,106 +1,228 @@
 #include "bitter.h"
-#include <stdlib.h>
+#include <assert.h>
 
-Node *node_create(void) {
-    Node *n = malloc(sizeof(Node));
+// The tiling tree: containers lay their children out side by side or
+// stacked, each child getting space in proportion to its weight, and views
+// sit in leaves. Every change marks the path up to the root dirty, and
+// node_arrange only descends into dirty subtrees or ones whose box moved.
+
+Node *node_create(NodeKind kind) {
+    Node *n = pool_alloc(&node_pool);
     *n = (Node) {
-        .kind = NodeTerminalVertical,
+        .kind = kind,
+        .dirty = true,
+        .weight = 1.0,
     };
-    wl_list_init(&n->children);
+    if (kind != NodeLeaf)
+        wl_list_init(&n->children);
     return n;
 }
 
 void node_destroy(Node *n) {
-    free(n);
+    if (n->kind != NodeLeaf) {
+        Node *child, *tmp;
+        wl_list_for_each_safe (child, tmp, &n->children, link) {
+            node_destroy(child);
+        }
+    } else if (n->view) {
+        n->view->tiled.node = NULL;
+    }
+    pool_free(&node_pool, n);
 }
 
-Node *node_insert(Node *n, View *view) {
-    switch (n->kind) {
-        case NodeHorizontal:
-        case NodeVertical: {
-            return node_insert(n->right, view);
-        }
-        case NodeTerminalHorizontal:
-        case NodeTerminalVertical: {
-            wl_list_insert(&n->children, &view->tiled.link);
+// A dirty node always has dirty ancestors, so we can stop early.
+static void node_invalidate(Node *n) {
+    for (; n && !n->dirty; n = n->parent)
+        n->dirty = true;
+}
+
+static void node_link(Node *parent, struct wl_list *after, Node *child) {
+    wl_list_insert(after, &child->link);
+    child->parent = parent;
+    parent->len++;
+    parent->total_weight += child->weight;
+    node_invalidate(parent);
+}
+
+static void node_unlink(Node *child) {
+    Node *parent = child->parent;
+    wl_list_remove(&child->link);
+    child->parent = NULL;
+    parent->len--;
+    parent->total_weight -= child->weight;
+    node_invalidate(parent);
+}
+
+static Node *node_first_leaf(Node *n) {
+    while (n->kind != NodeLeaf) {
+        if (n->len == 0)
             return n;
-        }
+        n = wl_container_of(n->children.next, n, link);
     }
+    return n;
 }
 
-void node_walk(Node *n,
-    void (*visit)(struct wl_list *link, struct wlr_box *box, void *data),
-    struct wlr_box *box, void *data)
-{
-    switch (n->kind) {
-        case NodeHorizontal: {
-            struct wlr_box child_box = {
-                .x = box->x,
-                .y = box->y,
-                .width = box->width / 2,
-                .height = box->height,
-            };
-            node_walk(n->left, visit, &child_box, data);
-            child_box.x += child_box.width;
-            node_walk(n->right, visit, &child_box, data);
-            break;
-        }
-        case NodeVertical: {
-            struct wlr_box child_box = {
-                .x = box->x,
-                .y = box->y,
-                .width = box->width,
-                .height = box->height / 2,
-            };
-            node_walk(n->left, visit, &child_box, data);
-            child_box.y += child_box.height;
-            node_walk(n->left, visit, &child_box, data);
-            break;
-        }
-        case NodeTerminalHorizontal: {
-            int len = wl_list_length(&n->children);
-            if (len == 0)
-                return;
-            struct wlr_box child_box = {
-                .x = box->x,
-                .y = box->y,
-                .width = box->width / len,
-                .height = box->height,
-            };
-            for (struct wl_list *pos = n->children.next;
-                pos != &n->children; pos = pos->next)
-            {
-                visit(pos, &child_box, data);
-                child_box.x += child_box.width;
-            }
-            break;
+// Puts the view in a new leaf right after the focused one, or at the end
+// if a container has focus. Returns the new leaf.
+Node *node_insert(Node *focus, View *view) {
+    Node *leaf = node_create(NodeLeaf);
+    leaf->view = view;
+    view->tiled.node = leaf;
+    if (focus->kind == NodeLeaf)
+        node_link(focus->parent, &focus->link, leaf);
+    else
+        node_link(focus, focus->children.prev, leaf);
+    return leaf;
+}
+
+// Removes the view's leaf. Containers left with a single child are replaced
+// by that child, and empty ones are removed, except for the root. Returns
+// the node that should get focus instead.
+Node *node_remove(View *view) {
+    Node *n = view->tiled.node;
+    if (view->out) {
+        view->out->grid.dirty = true;
+        view->out->scene.dirty = true;
+    }
+    view->tiled.node = NULL;
+    n->view = NULL;
+
+    Node *next = NULL;
+    while (n->parent) {
+        Node *parent = n->parent;
+        if (!next && parent->len > 1) {
+            struct wl_list *sibling = n->link.prev != &parent->children
+                ? n->link.prev : n->link.next;
+            next = node_first_leaf(wl_container_of(sibling, n, link));
         }
-        case NodeTerminalVertical: {
-            int len = wl_list_length(&n->children);
-            if (len == 0)
-                return;
-            struct wlr_box child_box = {
-                .x = box->x,
-                .y = box->y,
-                .width = box->width,
-                .height = box->height / len,
-            };
-            for (struct wl_list *pos = n->children.next;
-                pos != &n->children; pos = pos->next)
-            {
-                visit(pos, &child_box, data);
-                child_box.y += child_box.height;
-            }
+        node_unlink(n);
+        node_destroy(n);
+        if (parent->len > 0 || !parent->parent) {
+            n = parent;
             break;
         }
+        n = parent;
     }
+
+    if (n->parent && n->len == 1) {
+        Node *only = wl_container_of(n->children.next, only, link);
+        Node *grandparent = n->parent;
+        only->weight = n->weight;
+        node_unlink(only);
+        node_link(grandparent, &n->link, only);
+        node_unlink(n);
+        node_destroy(n);
+    }
+    return next ? next : node_first_leaf(n);
+}
+
+// Wraps the leaf in a new container with the given layout, unless its parent
+// already lays things out that way. Returns the container the leaf is in.
+Node *node_split(Node *leaf, NodeKind layout) {
+    assert(leaf->kind == NodeLeaf && layout != NodeLeaf);
+    Node *parent = leaf->parent;
+    if (parent->kind == layout || parent->len == 1) {
+        parent->kind = layout;
+        node_invalidate(parent);
+        return parent;
+    }
+    Node *container = node_create(layout);
+    container->weight = leaf->weight;
+    node_link(parent, &leaf->link, container);
+    node_unlink(leaf);
+    leaf->weight = 1.0;
+    node_link(container, &container->children, leaf);
+    return container;
 }
 
-static void node_configure_visit(struct wl_list *link, struct wlr_box *box, void *data) {
-    View *view = wl_container_of(link, view, tiled.link);
-    view_set_size(view, box->width, box->height);
+void node_swap(Node *a, Node *b) {
+    assert(a->kind == NodeLeaf && b->kind == NodeLeaf);
+    View *view = a->view;
+    a->view = b->view;
+    b->view = view;
+    if (a->view)
+        a->view->tiled.node = a;
+    if (b->view)
+        b->view->tiled.node = b;
+    if (a->view && a->view->out)
+        a->view->out->scene.dirty = true;
+    if (b->view && b->view->out)
+        b->view->out->scene.dirty = true;
+    // the boxes are unchanged, so make sure the views get them anyway
+    a->dirty = b->dirty = false;
+    node_invalidate(a);
+    node_invalidate(b);
 }
 
-void node_configure(Node *n, struct wlr_box *box) {
-    node_walk(n, node_configure_visit, box, NULL);
+// The leaf after this one in depth-first order, wrapping around.
+Node *node_next_leaf(Node *n) {
+    while (n->parent && n->link.next == &n->parent->children)
+        n = n->parent;
+    if (!n->parent)
+        return node_first_leaf(n);
+    return node_first_leaf(wl_container_of(n->link.next, n, link));
+}
+
+void node_set_weight(Node *n, double weight) {
+    if (weight <= 0.0)
+        return;
+    if (n->parent) {
+        n->parent->total_weight += weight - n->weight;
+        node_invalidate(n->parent);
+    }
+    n->weight = weight;
+}
+
+void node_for_each_view(Node *n, void (*visit)(View *, void *data),
+    void *data)
+{
+    if (n->kind == NodeLeaf) {
+        if (n->view)
+            visit(n->view, data);
+        return;
+    }
+    Node *child, *tmp;
+    wl_list_for_each_safe (child, tmp, &n->children, link) {
+        node_for_each_view(child, visit, data);
+    }
+}
+
+static bool box_equal(struct wlr_box *a, struct wlr_box *b) {
+    return a->x == b->x && a->y == b->y
+        && a->width == b->width && a->height == b->height;
+}
+
+void node_arrange(Node *n, Output *out, struct wlr_box *box) {
+    if (!n->dirty && box_equal(&n->box, box))
+        return;
+    n->box = *box;
+    n->dirty = false;
+    if (n->kind == NodeLeaf) {
+        if (n->view)
+            transaction_add_view(n->view, out, box);
+        return;
+    }
+    if (n->len == 0)
+        return;
+
+    // edges are rounded from running totals, so nothing is lost to rounding
+    bool horizontal = n->kind == NodeHorizontal;
+    int start = horizontal ? box->x : box->y;
+    int size = horizontal ? box->width : box->height;
+    double before = 0.0;
+    Node *child;
+    wl_list_for_each (child, &n->children, link) {
+        int from = start + (int)(before * size / n->total_weight + 0.5);
+        before += child->weight;
+        int to = start + (int)(before * size / n->total_weight + 0.5);
+        struct wlr_box child_box = *box;
+        if (horizontal) {
+            child_box.x = from;
+            child_box.width = to - from;
+        } else {
+            child_box.y = from;
+            child_box.height = to - from;
+        }
+        node_arrange(child, out, &child_box);
+    }
 }
@@ -1,131 +1,771 @@
 #include "bitter.h"
+#include <limits.h>
 #include <stdlib.h>
 #include <time.h>
 #include <wlr/interfaces/wlr_output.h>
+#include <wlr/types/wlr_output_damage.h>
 #include <wlr/types/wlr_output_layout.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_matrix.h>
+#include <wlr/util/log.h>
+#include <wlr/util/region.h>
 
-static void render_view(struct wl_list *link, struct wlr_box *box, void *data);
-static void render_surface(struct wlr_surface *surface, int sx, int sy, void *data);
+static int output_on_render_timer(void *data);
+static int output_on_throttle_timer(void *data);
+
+// The preferred resolution at the highest refresh rate it's offered with.
+static struct wlr_output_mode *output_best_mode(struct wlr_output *output) {
+    struct wlr_output_mode *preferred = wlr_output_preferred_mode(output);
+    if (!preferred)
+        return NULL;
+    struct wlr_output_mode *best = preferred, *mode;
+    wl_list_for_each (mode, &output->modes, link) {
+        if (mode->width == preferred->width
+            && mode->height == preferred->height
+            && mode->refresh > best->refresh)
+            best = mode;
+    }
+    return best;
+}
+
+static void output_enable(Output *out) {
+    struct wlr_output *output = out->output;
+    struct wlr_output_mode *mode = output_best_mode(output);
+    if (mode)
+        wlr_output_set_mode(output, mode);
+    wlr_output_enable(output, true);
+    if (out->srv->adaptive_sync) {
+        wlr_output_enable_adaptive_sync(output, true);
+        if (!wlr_output_test(output))
+            wlr_output_enable_adaptive_sync(output, false);
+    }
+    if (!wlr_output_commit(output)) {
+        wlr_log(WLR_ERROR, "failed to enable output %s", output->name);
+        return;
+    }
+    wlr_log(WLR_INFO, "output %s: %dx%d@%dmHz, adaptive sync %s",
+        output->name, output->width, output->height, output->refresh,
+        output->adaptive_sync_status == WLR_OUTPUT_ADAPTIVE_SYNC_ENABLED
+            ? "on" : "off");
+}
 
 Output *output_create(Server *srv, struct wlr_output *output) {
-    Output *out = malloc(sizeof(Output));
+    Output *out = pool_alloc(&output_pool);
     *out = (Output) {
         .srv = srv,
-        .root = node_create(),
+        .root = node_create(NodeHorizontal),
         .output = output,
+        .render_delay = srv->render_delay,
         .on_frame.notify = output_on_frame,
+        .on_present.notify = output_on_present,
+        .on_mode.notify = output_on_mode,
+        .on_scale.notify = output_on_scale,
+        .on_transform.notify = output_on_transform,
+        .on_destroy.notify = output_on_destroy,
     };
-    wl_signal_add(&out->output->events.frame, &out->on_frame);
+    out->render_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(srv->display), output_on_render_timer, out);
+    out->throttle_timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(srv->display), output_on_throttle_timer, out);
+    output->data = out;
+    // ahead of the damage's own destroy listener, so everything hooked to
+    // the damage is unhooked while it's still there
+    wl_signal_add(&out->output->events.destroy, &out->on_destroy);
+    out->damage = wlr_output_damage_create(output);
+    pixman_region32_init(&out->debug_tint);
+    wl_array_init(&out->render_items);
+    wl_array_init(&out->scene.views);
+    out->scene.dirty = true;
+    grid_init(&out->grid);
+    // wlr_output_damage already tracks software cursor damage and mode
+    // changes for us, so only view damage has to be added by hand.
+    wl_signal_add(&out->damage->events.frame, &out->on_frame);
+    wl_signal_add(&out->output->events.present, &out->on_present);
+    wl_signal_add(&out->output->events.mode, &out->on_mode);
+    wl_signal_add(&out->output->events.scale, &out->on_scale);
+    wl_signal_add(&out->output->events.transform, &out->on_transform);
     wl_list_insert(&srv->outputs, &out->link);
+    output_enable(out);
     wlr_output_layout_add_auto(srv->output_layout, out->output);
+    ipc_notify(srv, IPC_EVENT(IpcEventOutputs) | IPC_EVENT(IpcEventLayout));
     return out;
 }
 
-void output_destroy(Output *out) {
-    node_destroy(out->root);
-    wlr_output_layout_remove(out->srv->output_layout, out->output);
+static void collect_tiled_view(View *view, void *data) {
+    View **slot = wl_array_add(data, sizeof(*slot));
+    if (slot)
+        *slot = view;
+}
+
+void output_destroy(Output *out, void *data) {
+    Server *srv = out->srv;
     wl_list_remove(&out->link);
-    free(out);
+    ipc_notify(srv, IPC_EVENT(IpcEventOutputs) | IPC_EVENT(IpcEventLayout));
+    Node *focus_root = srv->focused;
+    while (focus_root && focus_root->parent)
+        focus_root = focus_root->parent;
+    if (focus_root == out->root)
+        srv->focused = NULL;
+    srv->hovered = NULL;
+
+    // views move to another output, or wait for one to show up; removing
+    // them collapses the tree, so it can't be walked at the same time
+    struct wl_array views;
+    wl_array_init(&views);
+    node_for_each_view(out->root, collect_tiled_view, &views);
+    View **view;
+    wl_array_for_each (view, &views) {
+        transaction_remove_view(*view);
+        node_remove(*view);
+        (*view)->out = NULL;
+        server_adopt_view(srv, *view);
+    }
+    wl_array_release(&views);
+    // views already on their way to another output
+    View *moving;
+    wl_list_for_each (moving, &srv->txn.views, txn.link) {
+        if (moving->out == out)
+            moving->out = NULL;
+    }
+
+    wl_list_remove(&out->on_frame.link);
+    wl_list_remove(&out->on_present.link);
+    wl_list_remove(&out->on_mode.link);
+    wl_list_remove(&out->on_scale.link);
+    wl_list_remove(&out->on_transform.link);
+    wl_list_remove(&out->on_destroy.link);
+    wl_event_source_remove(out->render_timer);
+    wl_event_source_remove(out->throttle_timer);
+    pixman_region32_fini(&out->debug_tint);
+    wl_array_release(&out->render_items);
+    wl_array_release(&out->scene.views);
+    grid_finish(&out->grid);
+    composite_output_finish(out);
+    node_destroy(out->root);
+    wlr_output_layout_remove(srv->output_layout, out->output);
+    out->output->data = NULL;
+    pool_free(&output_pool, out);
 }
 
-typedef struct ViewRenderData ViewRenderData;
-struct ViewRenderData {
-    Output *out;
-    struct timespec *when;
-};
+void output_get_box(Output *out, struct wlr_box *box) {
+    *box = (struct wlr_box) { .x = 0, .y = 0 };
+    wlr_output_effective_resolution(out->output, &box->width, &box->height);
+}
 
-void output_frame(Output *out, void *data) {
-    struct timespec now;
-    clock_gettime(CLOCK_MONOTONIC, &now);
-    wlr_output_attach_render(out->output, NULL);
-    int width, height;
-    wlr_output_effective_resolution(out->output, &width, &height);
-    wlr_renderer_begin(out->srv->renderer, width, height);
-    wlr_renderer_clear(out->srv->renderer, (float[4]){0.0f, 0.5f, 0.5f, 1.0f});
-    ViewRenderData vdata = {
-        .out = out,
-        .when = &now,
+// Scales the edges rather than the size, so boxes that touch in layout
+// coordinates still touch once scaled.
+void scale_box(struct wlr_box *box, float scale) {
+    box->width = (box->x + box->width) * scale - (int)(box->x * scale);
+    box->height = (box->y + box->height) * scale - (int)(box->y * scale);
+    box->x *= scale;
+    box->y *= scale;
+}
+
+void output_damage_whole(Output *out) {
+    wlr_output_damage_add_whole(out->damage);
+}
+
+void output_damage_box(Output *out, struct wlr_box *box) {
+    struct wlr_box scaled = *box;
+    scale_box(&scaled, out->output->scale);
+    wlr_output_damage_add_box(out->damage, &scaled);
+}
+
+void output_damage_surface(Output *out, struct wlr_surface *surface,
+    int x, int y, bool whole)
+{
+    struct wlr_box box = {
+        .x = x,
+        .y = y,
+        .width = surface->current.width,
+        .height = surface->current.height,
     };
-    struct wlr_box there = {
-        .x = 0,
-        .y = 0,
-        .width = out->output->width,
-        .height = out->output->height,
+    if (whole) {
+        output_damage_box(out, &box);
+        return;
+    }
+
+    pixman_region32_t damage;
+    pixman_region32_init(&damage);
+    wlr_surface_get_effective_damage(surface, &damage);
+    wlr_region_scale(&damage, &damage, out->output->scale);
+    // rounding can leave slivers of stale pixels on fractional scales
+    if (out->output->scale != (int)out->output->scale)
+        wlr_region_expand(&damage, &damage, 1);
+    scale_box(&box, out->output->scale);
+    pixman_region32_translate(&damage, box.x, box.y);
+    wlr_output_damage_add(out->damage, &damage);
+    pixman_region32_fini(&damage);
+    // empty damage doesn't schedule a frame, but the client still waits
+    // for its frame callbacks
+    if (!wl_list_empty(&surface->current.frame_callback_list))
+        wlr_output_schedule_frame(out->output);
+}
+
+// Refresh period in microseconds, guessing 60Hz when the backend can't say.
+static int output_refresh_usec(Output *out) {
+    int refresh = out->output->refresh > 0 ? out->output->refresh : 60000;
+    return 1000000000 / refresh;
+}
+
+// The worst of the recent render times, in microseconds.
+static int output_predicted_render_usec(Output *out) {
+    int predicted = 0;
+    for (int i = 0; i < out->render_times_len; i++) {
+        if (out->render_times[i] > predicted)
+            predicted = out->render_times[i];
+    }
+    return predicted;
+}
+
+// Milliseconds to wait after a frame event before rendering. The frame
+// event arrives right after vblank, so rendering as late as possible still
+// hitting the next one gives clients most of the refresh period to commit.
+static int output_render_delay(Output *out) {
+    if (out->render_delay != RENDER_DELAY_AUTO) {
+        int max = output_refresh_usec(out) / 1000 - 1;
+        return out->render_delay < max ? out->render_delay : max;
+    }
+    if (out->render_times_len == 0)
+        return 0;
+    int delay = output_refresh_usec(out) - output_predicted_render_usec(out)
+        - RENDER_MARGIN_USEC;
+    return delay > 0 ? delay / 1000 : 0;
+}
+
+static void output_record_render_time(Output *out, struct timespec *start,
+    int surfaces, int drawn)
+{
+    int64_t usec = now_usec() - timespec_to_usec(start);
+    if (usec > INT_MAX)
+        usec = INT_MAX;
+    out->render_times[out->render_times_pos] = usec;
+    out->render_times_pos = (out->render_times_pos + 1) % RENDER_TIMES_LEN;
+    if (out->render_times_len < RENDER_TIMES_LEN)
+        out->render_times_len++;
+    stats_record_frame(&out->stats, usec, surfaces, drawn,
+        out->srv->upload_bytes);
+}
+
+static void scissor_output(Output *out, pixman_box32_t *rect) {
+    struct wlr_box box = {
+        .x = rect->x1,
+        .y = rect->y1,
+        .width = rect->x2 - rect->x1,
+        .height = rect->y2 - rect->y1,
     };
-    node_walk(out->root, render_view, &there, &vdata);
-    wlr_output_render_software_cursors(out->output, NULL);
-    wlr_renderer_end(out->srv->renderer);
-    wlr_output_commit(out->output);
+    int width, height;
+    wlr_output_transformed_resolution(out->output, &width, &height);
+    enum wl_output_transform transform =
+        wlr_output_transform_invert(out->output->transform);
+    wlr_box_transform(&box, &box, transform, width, height);
+    wlr_renderer_scissor(out->srv->renderer, &box);
+}
+
+static void render_damage_tint(Output *out) {
+    // tint what's new this frame, and repaint last frame's tint away
+    pixman_region32_t tint;
+    pixman_region32_init(&tint);
+    pixman_region32_subtract(&tint, &out->damage->current, &out->debug_tint);
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(&tint, &nrects);
+    for (int i = 0; i < nrects; i++) {
+        struct wlr_box box = {
+            .x = rects[i].x1,
+            .y = rects[i].y1,
+            .width = rects[i].x2 - rects[i].x1,
+            .height = rects[i].y2 - rects[i].y1,
+        };
+        scissor_output(out, &rects[i]);
+        wlr_render_rect(out->srv->renderer, &box,
+            (float[4]){0.5f, 0.0f, 0.0f, 0.5f},
+            out->output->transform_matrix);
+    }
+    pixman_region32_copy(&out->debug_tint, &tint);
+    pixman_region32_fini(&tint);
+}
+
+// With adaptive sync the display refreshes when we commit, so a single
+// fullscreen view, like a game, is best served by rendering the moment it
+// commits rather than waiting for a point in a fixed refresh cycle.
+static bool output_paced_by_client(Output *out) {
+    if (out->output->adaptive_sync_status != WLR_OUTPUT_ADAPTIVE_SYNC_ENABLED)
+        return false;
+    scene_update(out);
+    if (out->scene.views.size != sizeof(View *))
+        return false;
+    // a client committing flat out doesn't get to drive the display too
+    View *view = *(View **)out->scene.views.data;
+    SceneItem *item = view->scene.items.data;
+    return view->scene.items.size == 0 || !item->surface
+        || !account_runaway(wl_resource_get_client(item->surface->resource));
+}
+
+void output_frame(Output *out, void *data) {
+    // keep the old layout up; applying the transaction damages us again
+    if (out->render_pending || transaction_blocks_output(out->srv, out))
+        return;
+    int delay = output_paced_by_client(out) ? 0 : output_render_delay(out);
+    if (delay == 0) {
+        output_render(out);
+        return;
+    }
+    out->render_pending = true;
+    out->render_deadline = now_usec() + output_refresh_usec(out)
+        - RENDER_MARGIN_USEC;
+    wl_event_source_timer_update(out->render_timer, delay);
+}
+
+void output_present(Output *out, struct wlr_output_event_present *event) {
+    stats_record_present(&out->stats, event);
+}
+
+// The layout is arranged for the output's size in layout coordinates, so
+// anything that changes it needs a relayout.
+static void output_resized(Output *out) {
+    server_reconfigure_output(out->srv, out);
+    ipc_notify(out->srv, IPC_EVENT(IpcEventOutputs));
+}
+
+void output_mode(Output *out, void *data) {
+    output_resized(out);
+}
+
+void output_scale(Output *out, void *data) {
+    output_resized(out);
+}
+
+void output_transform(Output *out, void *data) {
+    output_resized(out);
+}
+
+// Everything renders on the one event loop thread, so a slow output can make
+// the next one miss its vblank. Before rendering, let any output that would
+// otherwise be late go first, earliest deadline first.
+static void output_render_earlier_deadlines(Output *out) {
+    for (;;) {
+        int64_t busy_until = now_usec() + output_predicted_render_usec(out);
+        Output *first = NULL, *other;
+        wl_list_for_each (other, &out->srv->outputs, link) {
+            if (other == out || !other->render_pending
+                || other->render_deadline >= out->render_deadline
+                || other->render_deadline - output_predicted_render_usec(other)
+                    >= busy_until)
+                continue;
+            if (!first || other->render_deadline < first->render_deadline)
+                first = other;
+        }
+        if (!first)
+            return;
+        first->render_pending = false;
+        wl_event_source_timer_update(first->render_timer, 0);
+        output_render(first);
+    }
+}
+
+static int output_on_render_timer(void *data) {
+    Output *out = data;
+    out->render_pending = false;
+    output_render_earlier_deadlines(out);
+    output_render(out);
+    return 0;
+}
+
+View *output_view_at(Output *out, double x, double y,
+    struct wlr_surface **surface, double *sx, double *sy)
+{
+    struct wlr_box box;
+    output_get_box(out, &box);
+    if (out->grid.dirty || box.width != out->grid.box.width
+        || box.height != out->grid.box.height)
+        grid_rebuild(&out->grid, out->root, &box);
+    return grid_view_at(&out->grid, x, y, surface, sx, sy);
+}
+
+// How often the surface gets frame callbacks, or 0 for every frame. Only
+// what has focus runs at full rate, unless its client commits without
+// waiting for them anyway.
+static int frame_done_rate(Server *srv, View *view,
+    struct wlr_surface *surface, bool visible)
+{
+    if (!visible)
+        return THROTTLE_HIDDEN_HZ;
+    if (srv->unfocused_hz == 0)
+        return 0;
+    Node *focused = srv->focused;
+    if (focused && focused->kind == NodeLeaf && focused->view == view
+        && !account_runaway(wl_resource_get_client(surface->resource)))
+        return 0;
+    return srv->unfocused_hz;
+}
+
+// Sends the surface its frame callbacks unless it's throttled, in which
+// case wake is pulled in to when they're due.
+static void frame_done_surface(Output *out, View *view,
+    struct wlr_surface *surface, bool visible, struct timespec *when,
+    int64_t *wake)
+{
+    int64_t now = timespec_to_usec(when);
+    int hz = frame_done_rate(out->srv, view, surface, visible);
+    // a view's surfaces are throttled together, within the same frame
+    if (hz > 0 && view->frame_done != now
+        && now - view->frame_done < 1000000 / hz)
+    {
+        // nothing else may cause another frame before it's due
+        int64_t due = view->frame_done + 1000000 / hz;
+        if (!wl_list_empty(&surface->current.frame_callback_list)
+            && (*wake == 0 || due < *wake))
+            *wake = due;
+        return;
+    }
+    if (hz > 0)
+        view->frame_done = now;
+    wlr_surface_send_frame_done(surface, when);
+}
+
+static void throttle_until(Output *out, struct timespec *when, int64_t wake) {
+    if (wake > 0) {
+        wl_event_source_timer_update(out->throttle_timer,
+            (wake - timespec_to_usec(when) + 999) / 1000);
+    }
+}
+
+static void send_frame_done(Output *out, struct timespec *when) {
+    int64_t wake = 0;
+    RenderItem *item;
+    wl_array_for_each (item, &out->render_items) {
+        frame_done_surface(out, item->scene->view, item->surface,
+            pixman_region32_not_empty(&item->visible), when, &wake);
+    }
+    throttle_until(out, when, wake);
+}
+
+// A scanned out surface covers the whole output, so it's always visible.
+static void send_scanout_frame_done(Output *out, View *view,
+    struct wlr_surface *surface, struct timespec *when)
+{
+    int64_t wake = 0;
+    frame_done_surface(out, view, surface, true, when, &wake);
+    throttle_until(out, when, wake);
 }
 
-typedef struct SurfaceRenderData SurfaceRenderData;
-struct SurfaceRenderData {
+typedef struct ScanoutData ScanoutData;
+struct ScanoutData {
     View *view;
-    Output *out;
-    struct wlr_box *where;
-    struct timespec *when;
+    int views;
+    struct wlr_surface *surface;
+    int surfaces;
 };
 
-static int int_min(int a, int b) {
-    return a < b ? a : b;
-}
-
-static void render_view(struct wl_list *link, struct wlr_box *box, void *data) {
-    View *view = wl_container_of(link, view, tiled.link); // TODO
-    XdgSurface *xdg_surface = (XdgSurface *)view;
-    ViewRenderData *vdata = data;
-    SurfaceRenderData sdata = {
-        .view = view,
-        .out = vdata->out,
-        .where = &(struct wlr_box) {
-            // TODO: this seems like a hack, but it makes alacritty's csd work in tiling.
-            // hopefully it actually works everywhere.
-            .x = box->x - int_min(0, xdg_surface->surface->geometry.x),
-            .y = box->y - int_min(0, xdg_surface->surface->geometry.y),
-            .width = box->width,
-            .height = box->height,
-        },
-        .when = vdata->when,
-    };
-    view_for_each_surface(view, render_surface, &sdata);
+static void scanout_count_view(View *view, void *data) {
+    ScanoutData *sdata = data;
+    sdata->view = view;
+    sdata->views++;
 }
 
-static void render_surface(
+static void scanout_count_surface(
     struct wlr_surface *surface, int sx, int sy, void *data)
 {
-    SurfaceRenderData *sdata = data;
-    struct wlr_texture *texture = wlr_surface_get_texture(surface);
-    if (!texture)
-        return;
+    ScanoutData *sdata = data;
+    sdata->surface = surface;
+    sdata->surfaces++;
+}
 
-    double ox = 0, oy = 0;
-    wlr_output_layout_output_coords(sdata->view->srv->output_layout,
-        sdata->out->output, &ox, &oy);
+// The surface to put on screen without compositing, if there's exactly one
+// view with a single opaque surface that exactly covers the output.
+static struct wlr_surface *output_scanout_surface(Output *out, View **view) {
+    struct wlr_output *output = out->output;
+    if (out->srv->debug_damage || out->srv->overlay)
+        return NULL;
+    struct wlr_output_cursor *cursor;
+    wl_list_for_each (cursor, &output->cursors, link) {
+        // software cursors need compositing
+        if (cursor->enabled && cursor->visible
+            && cursor != output->hardware_cursor)
+            return NULL;
+    }
 
-    ox += sdata->where->x + sx;
-    oy += sdata->where->y + sy;
+    ScanoutData sdata = {0};
+    node_for_each_view(out->root, scanout_count_view, &sdata);
+    if (sdata.views != 1)
+        return NULL;
+    view_for_each_surface(sdata.view, scanout_count_surface, &sdata);
+    if (sdata.surfaces != 1)
+        return NULL;
 
-    struct wlr_box box = {
-        .x = ox,
-        .y = oy,
-        .width = surface->current.width,
-        .height = surface->current.height,
+    struct wlr_surface *surface = sdata.surface;
+    if (!surface->buffer)
+        return NULL;
+    if (surface->current.scale != output->scale
+        || surface->current.transform != output->transform
+        || surface->current.buffer_width != output->width
+        || surface->current.buffer_height != output->height)
+        return NULL;
+
+    int x, y;
+    view_get_origin(sdata.view, &x, &y);
+    if (x != 0 || y != 0)
+        return NULL;
+    pixman_box32_t extents = {
+        .x1 = 0,
+        .y1 = 0,
+        .x2 = surface->current.width,
+        .y2 = surface->current.height,
     };
+    if (pixman_region32_contains_rectangle(&surface->opaque_region, &extents)
+        != PIXMAN_REGION_IN)
+        return NULL;
+    *view = sdata.view;
+    return surface;
+}
+
+// Hands the client's buffer straight to the output, skipping composition.
+// Returns false if the backend can't take it, in which case we render.
+static bool output_scanout(Output *out, struct timespec *when) {
+    if (capture_pending(out))
+        return false;
+    View *view;
+    struct wlr_surface *surface = output_scanout_surface(out, &view);
+    if (!surface)
+        return false;
+
+    if (!out->output->needs_frame
+        && !pixman_region32_not_empty(&out->damage->current))
+    {
+        send_scanout_frame_done(out, view, surface, when);
+        return true;
+    }
+
+    wlr_output_attach_buffer(out->output, &surface->buffer->base);
+    if (!wlr_output_test(out->output)) {
+        wlr_output_rollback(out->output);
+        return false;
+    }
+    if (!wlr_output_commit(out->output))
+        return false;
+    stats_record_commit(&out->stats, out->output->commit_seq);
+    startup_first_frame(out->srv);
+    out->stats.scanout++;
+    out->scanout = true;
+    send_scanout_frame_done(out, view, surface, when);
+    return true;
+}
+
+// Gathers every on-screen surface bottom to top, then walks them top to
+// bottom cutting away whatever is hidden under opaque regions above.
+// Leaves the union of all opaque regions in opaque, in buffer coordinates.
+static void output_cull(Output *out, pixman_region32_t *opaque) {
+    scene_update(out);
+    struct wlr_box output_box, visible;
+    output_get_box(out, &output_box);
+    View **view;
+    wl_array_for_each (view, &out->scene.views) {
+        SceneItem *scene;
+        wl_array_for_each (scene, &(*view)->scene.items) {
+            if (!scene->surface
+                || !wlr_box_intersection(&visible, &scene->box, &output_box))
+                continue;
+            struct wlr_texture *texture =
+                wlr_surface_get_texture(scene->surface);
+            if (!texture)
+                continue;
+            RenderItem *item = wl_array_add(&out->render_items, sizeof(*item));
+            if (!item)
+                continue;
+            *item = (RenderItem) {
+                .surface = scene->surface,
+                .texture = texture,
+                .scene = scene,
+            };
+            struct wlr_box *box = &scene->buffer_box;
+            pixman_region32_init_rect(&item->visible,
+                box->x, box->y, box->width, box->height);
+        }
+    }
+
+    RenderItem *items = out->render_items.data;
+    size_t len = out->render_items.size / sizeof(*items);
+    for (size_t i = len; i-- > 0;) {
+        RenderItem *item = &items[i];
+        pixman_region32_subtract(&item->visible, &item->visible, opaque);
+        pixman_region32_union(opaque, opaque, &item->scene->opaque);
+    }
+}
+
+static void output_release_items(Output *out) {
+    RenderItem *item;
+    wl_array_for_each (item, &out->render_items) {
+        pixman_region32_fini(&item->visible);
+    }
+    out->render_items.size = 0;
+}
+
+// Returns whether any of the item needed repainting.
+static bool render_item(Output *out, RenderItem *item,
+    pixman_region32_t *output_damage)
+{
+    pixman_region32_t damage;
+    pixman_region32_init(&damage);
+    pixman_region32_intersect(&damage, &item->visible, output_damage);
+    bool drawn = pixman_region32_not_empty(&damage);
+    if (drawn) {
+        int nrects;
+        pixman_box32_t *rects = pixman_region32_rectangles(&damage, &nrects);
+        for (int i = 0; i < nrects; i++) {
+            scissor_output(out, &rects[i]);
+            wlr_render_texture_with_matrix(
+                out->srv->renderer, item->texture, item->scene->matrix, 1);
+        }
+    }
+    pixman_region32_fini(&damage);
+    return drawn;
+}
+
+static int render_scene(Output *out, pixman_region32_t *damage,
+    pixman_region32_t *opaque)
+{
+    // the background only shows where nothing opaque covers it
+    pixman_region32_t background;
+    pixman_region32_init(&background);
+    pixman_region32_subtract(&background, damage, opaque);
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(&background, &nrects);
+    for (int i = 0; i < nrects; i++) {
+        scissor_output(out, &rects[i]);
+        wlr_renderer_clear(out->srv->renderer,
+            (float[4]){0.0f, 0.5f, 0.5f, 1.0f});
+    }
+    pixman_region32_fini(&background);
+
+    int drawn = 0;
+    RenderItem *item;
+    wl_array_for_each (item, &out->render_items) {
+        drawn += render_item(out, item, damage);
+    }
+    return drawn;
+}
+
+// Draws a frame composited on the CPU, which covers the whole output.
+static void render_frame(Output *out, struct wlr_texture *frame,
+    pixman_region32_t *damage)
+{
+    int nrects;
+    pixman_box32_t *rects = pixman_region32_rectangles(damage, &nrects);
+    for (int i = 0; i < nrects; i++) {
+        scissor_output(out, &rects[i]);
+        wlr_render_texture(out->srv->renderer, frame,
+            out->output->transform_matrix, 0, 0, 1.0f);
+    }
+}
+
+static int output_on_throttle_timer(void *data) {
+    Output *out = data;
+    wlr_output_schedule_frame(out->output);
+    return 0;
+}
+
+void output_render(Output *out) {
+    struct wlr_renderer *renderer = out->srv->renderer;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // nothing was rendered, so there's no render time to record
+    if (output_scanout(out, &now))
+        return;
+    if (out->scanout) {
+        // our own buffers are stale after scanning out a client's
+        out->scanout = false;
+        out->cpu.valid = false;
+        wlr_output_damage_add_whole(out->damage);
+    }
+
+    pixman_region32_t opaque;
+    pixman_region32_init(&opaque);
+    output_cull(out, &opaque);
+
+    bool needs_frame;
+    pixman_region32_t damage;
+    pixman_region32_init(&damage);
+    if (!wlr_output_damage_attach_render(out->damage, &needs_frame, &damage))
+        goto done;
+
+    if (!needs_frame) {
+        // nothing changed; skip the repaint but keep clients ticking
+        wlr_output_rollback(out->output);
+        send_frame_done(out, &now);
+        goto done;
+    }
+
+    struct wlr_box overlay;
+    if (out->srv->overlay) {
+        // repainted with every frame we'd draw anyway, never on its own
+        stats_overlay_box(out, &overlay);
+        pixman_region32_union_rect(&damage, &damage,
+            overlay.x, overlay.y, overlay.width, overlay.height);
+    }
+
+    int width, height;
+    wlr_output_transformed_resolution(out->output, &width, &height);
+    wlr_renderer_begin(renderer, width, height);
+
+    int drawn = 0;
+    if (pixman_region32_not_empty(&damage)) {
+        struct wlr_texture *frame = out->srv->cpu_composite
+            ? composite_frame(out, &damage, &opaque, &drawn) : NULL;
+        if (frame)
+            render_frame(out, frame, &damage);
+        else
+            drawn = render_scene(out, &damage, &opaque);
+        if (out->srv->debug_damage)
+            render_damage_tint(out);
+        if (out->srv->overlay) {
+            wlr_renderer_scissor(renderer, NULL);
+            stats_render_overlay(out);
+        }
+    }
+    send_frame_done(out, &now);
+
+    wlr_output_render_software_cursors(out->output, &damage);
+    wlr_renderer_scissor(renderer, NULL);
+    wlr_renderer_end(renderer);
 
-    float matrix[9];
+    pixman_region32_t frame_damage, buffer_damage;
+    pixman_region32_init(&frame_damage);
+    pixman_region32_init(&buffer_damage);
+    pixman_region32_copy(&buffer_damage, &out->damage->current);
+    if (out->srv->overlay) {
+        pixman_region32_union_rect(&buffer_damage, &buffer_damage,
+            overlay.x, overlay.y, overlay.width, overlay.height);
+    }
     enum wl_output_transform transform =
-        wlr_output_transform_invert(surface->current.transform);
-    wlr_matrix_project_box(matrix, &box, transform, 0,
-        sdata->out->output->transform_matrix);
-    wlr_render_texture_with_matrix(
-        sdata->out->srv->renderer, texture, matrix, 1);
+        wlr_output_transform_invert(out->output->transform);
+    wlr_region_transform(&frame_damage, &buffer_damage,
+        transform, width, height);
+    wlr_output_set_damage(out->output, &frame_damage);
+    // screencopy reads back during the commit, so that's what it costs
+    CaptureCensus census;
+    capture_census(out, pixman_region32_not_empty(&frame_damage), &census);
+    pixman_region32_fini(&buffer_damage);
+    pixman_region32_fini(&frame_damage);
+    int64_t commit_start = now_usec();
+    if (wlr_output_commit(out->output)) {
+        stats_record_commit(&out->stats, out->output->commit_seq);
+        startup_first_frame(out->srv);
+        capture_record(out, &census, now_usec() - commit_start);
+        output_record_render_time(out, &now,
+            out->render_items.size / sizeof(RenderItem), drawn);
+    }
+    if (pixman_region32_not_empty(&out->debug_tint))
+        wlr_output_damage_add(out->damage, &out->debug_tint);
 
-    wlr_surface_send_frame_done(surface, sdata->when);
+done:
+    pixman_region32_fini(&damage);
+    pixman_region32_fini(&opaque);
+    output_release_items(out);
 }
 
 void output_configure(Output *out) {
-    struct wlr_box *output_box = wlr_output_layout_get_box(out->srv->output_layout, out->output);
-    node_configure(out->root, output_box);
+    struct wlr_box output_box;
+    output_get_box(out, &output_box);
+    node_arrange(out->root, out, &output_box);
 }
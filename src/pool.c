@@ -0,0 +1,113 @@
+#include "bitter.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <wlr/util/log.h>
+
+// Fixed-size objects come out of slabs of POOL_SLAB_OBJECTS, so tree nodes
+// and views end up next to each other in memory, and freed objects go on a
+// per-type free list that the next allocation takes from.
+
+typedef struct PoolSlab PoolSlab;
+struct PoolSlab {
+    PoolSlab *next;
+    max_align_t objects[];
+};
+
+typedef struct PoolFree PoolFree;
+struct PoolFree {
+    PoolFree *next;
+};
+
+#define POOL(type, pool_name) \
+    Pool pool_name = { .name = #type, .size = sizeof(type) };
+
+POOL(Node, node_pool)
+POOL(XdgSurface, xdg_surface_pool)
+POOL(XdgPopup, xdg_popup_pool)
+POOL(Subsurface, subsurface_pool)
+POOL(Keyboard, keyboard_pool)
+POOL(Output, output_pool)
+POOL(UploadTracker, upload_tracker_pool)
+POOL(ClientAccount, client_account_pool)
+
+static Pool *pools[] = {
+    &node_pool,
+    &xdg_surface_pool,
+    &xdg_popup_pool,
+    &subsurface_pool,
+    &keyboard_pool,
+    &output_pool,
+    &upload_tracker_pool,
+    &client_account_pool,
+};
+
+static size_t pool_stride(Pool *pool) {
+    size_t align = _Alignof(max_align_t);
+    return (pool->size + align - 1) / align * align;
+}
+
+static bool pool_grow(Pool *pool) {
+    size_t stride = pool_stride(pool);
+    PoolSlab *slab = malloc(sizeof(PoolSlab) + stride * POOL_SLAB_OBJECTS);
+    if (!slab)
+        return false;
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->capacity += POOL_SLAB_OBJECTS;
+    // push in reverse so objects are handed out in address order
+    char *base = (char *)slab->objects;
+    for (int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+        PoolFree *obj = (PoolFree *)(base + stride * i);
+        obj->next = pool->free;
+        pool->free = obj;
+    }
+    return true;
+}
+
+void *pool_alloc(Pool *pool) {
+    if (!pool->free && !pool_grow(pool))
+        return NULL;
+    PoolFree *obj = pool->free;
+    pool->free = obj->next;
+    pool->allocs++;
+    if (++pool->live > pool->peak)
+        pool->peak = pool->live;
+    return obj;
+}
+
+void pool_free(Pool *pool, void *ptr) {
+    if (!ptr)
+        return;
+    PoolFree *obj = ptr;
+    obj->next = pool->free;
+    pool->free = obj;
+    pool->live--;
+}
+
+// Slabs are only returned to the system once nothing in them is in use.
+void pool_finish_all(void) {
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        Pool *pool = pools[i];
+        if (pool->live > 0) {
+            wlr_log(WLR_ERROR, "pool %s: %zu objects leaked",
+                pool->name, pool->live);
+            continue;
+        }
+        while (pool->slabs) {
+            PoolSlab *slab = pool->slabs;
+            pool->slabs = slab->next;
+            free(slab);
+        }
+        pool->free = NULL;
+        pool->capacity = 0;
+    }
+}
+
+void pool_dump_all(void) {
+    for (size_t i = 0; i < sizeof(pools) / sizeof(pools[0]); i++) {
+        Pool *pool = pools[i];
+        wlr_log(WLR_INFO, "pool %s: %zu live, %zu peak, %zu capacity, "
+            "%llu allocations", pool->name, pool->live, pool->peak,
+            pool->capacity, (unsigned long long)pool->allocs);
+    }
+}
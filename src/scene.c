@@ -0,0 +1,123 @@
+#include "bitter.h"
+#include <wlr/render/wlr_renderer.h>
+#include <wlr/types/wlr_matrix.h>
+#include <wlr/types/wlr_surface.h>
+#include <wlr/util/region.h>
+
+// The scene keeps what rendering needs from each view's surfaces: where they
+// are on the output, their projection matrix and their opaque region, all
+// in buffer coordinates. Views are only walked again once something about
+// them changed, and the output's list of views only when the tree did, so
+// a frame is a flat pass over items that are already laid out.
+
+static void scene_view_clear(View *view) {
+    SceneItem *item;
+    wl_array_for_each (item, &view->scene.items) {
+        if (item->surface)
+            wl_list_remove(&item->on_destroy.link);
+        pixman_region32_fini(&item->opaque);
+    }
+    view->scene.items.size = 0;
+}
+
+typedef struct SceneData SceneData;
+struct SceneData {
+    View *view;
+    Output *out;
+    int x, y;
+};
+
+static void scene_add_surface(
+    struct wlr_surface *surface, int sx, int sy, void *data)
+{
+    SceneData *sdata = data;
+    SceneItem *item = wl_array_add(&sdata->view->scene.items, sizeof(*item));
+    if (!item)
+        return;
+    struct wlr_output *output = sdata->out->output;
+    *item = (SceneItem) {
+        .view = sdata->view,
+        .surface = surface,
+        .on_destroy.notify = scene_item_on_destroy,
+        .box = {
+            .x = sdata->x + sx,
+            .y = sdata->y + sy,
+            .width = surface->current.width,
+            .height = surface->current.height,
+        },
+    };
+    item->buffer_box = item->box;
+    scale_box(&item->buffer_box, output->scale);
+    enum wl_output_transform transform =
+        wlr_output_transform_invert(surface->current.transform);
+    wlr_matrix_project_box(item->matrix, &item->buffer_box, transform, 0,
+        output->transform_matrix);
+
+    pixman_region32_init(&item->opaque);
+    wlr_region_scale(&item->opaque, &surface->opaque_region, output->scale);
+    pixman_region32_translate(&item->opaque,
+        item->buffer_box.x, item->buffer_box.y);
+    pixman_region32_intersect_rect(&item->opaque, &item->opaque,
+        item->buffer_box.x, item->buffer_box.y,
+        item->buffer_box.width, item->buffer_box.height);
+}
+
+static void scene_view_update(View *view, Output *out) {
+    scene_view_clear(view);
+    SceneData sdata = {
+        .view = view,
+        .out = out,
+    };
+    view_get_origin(view, &sdata.x, &sdata.y);
+    view_for_each_surface(view, scene_add_surface, &sdata);
+    // only now that the array is done moving around
+    SceneItem *item;
+    wl_array_for_each (item, &view->scene.items) {
+        wl_signal_add(&item->surface->events.destroy, &item->on_destroy);
+    }
+    view->scene.dirty = false;
+}
+
+// Subsurfaces can go away without their view being committed to.
+void scene_item_destroy(SceneItem *item, void *data) {
+    wl_list_remove(&item->on_destroy.link);
+    item->surface = NULL;
+    item->view->scene.dirty = true;
+}
+
+void scene_view_finish(View *view) {
+    scene_view_clear(view);
+    wl_array_release(&view->scene.items);
+}
+
+static void scene_add_view(View *view, void *data) {
+    Output *out = data;
+    View **slot = wl_array_add(&out->scene.views, sizeof(*slot));
+    if (slot)
+        *slot = view;
+}
+
+// Brings the output's scene up to date before a frame.
+void scene_update(Output *out) {
+    struct wlr_output *output = out->output;
+    bool moved = output->scale != out->scene.scale
+        || output->transform != out->scene.transform
+        || output->width != out->scene.width
+        || output->height != out->scene.height;
+    if (moved) {
+        out->scene.scale = output->scale;
+        out->scene.transform = output->transform;
+        out->scene.width = output->width;
+        out->scene.height = output->height;
+    }
+    if (out->scene.dirty) {
+        out->scene.views.size = 0;
+        node_for_each_view(out->root, scene_add_view, out);
+        out->scene.dirty = false;
+    }
+    View **view;
+    wl_array_for_each (view, &out->scene.views) {
+        if (moved || (*view)->scene.dirty)
+            scene_view_update(*view, out);
+    }
+}
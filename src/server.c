@@ -1,6 +1,7 @@
 #include "bitter.h"
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <wayland-server-core.h>
 #include <wlr/backend.h>
 #include <wlr/types/wlr_compositor.h>
@@ -8,34 +9,66 @@
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/types/wlr_cursor.h>
 #include <wlr/types/wlr_output_layout.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
 #include <wlr/types/wlr_seat.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/util/log.h>
 
+static int parse_render_delay(const char *str) {
+    if (!str)
+        return 0;
+    if (strcmp(str, "auto") == 0)
+        return RENDER_DELAY_AUTO;
+    int delay = atoi(str);
+    return delay > 0 ? delay : 0;
+}
+
+static int parse_unfocused_hz(const char *str) {
+    if (!str)
+        return THROTTLE_UNFOCUSED_HZ;
+    int hz = atoi(str);
+    return hz > 0 ? hz : 0;
+}
+
 Server *server_create(void) {
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     struct Server *srv = malloc(sizeof(Server));
     struct wl_display *display = wl_display_create();
+    // clients can connect while everything else starts, they're served as
+    // soon as the event loop runs
+    const char *socket = wl_display_add_socket_auto(display);
+    struct timespec socket_time, backend_time;
+    clock_gettime(CLOCK_MONOTONIC, &socket_time);
     struct wlr_backend *backend = wlr_backend_autocreate(display, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &backend_time);
+    // only now, or autocreate would take our own socket for a parent
+    // compositor and nest bitter inside itself
+    if (socket)
+        setenv("WAYLAND_DISPLAY", socket, true);
     struct wlr_renderer *renderer = wlr_backend_get_renderer(backend);
     struct wlr_output_layout *output_layout = wlr_output_layout_create();
     struct wlr_xdg_shell *xdg_shell = wlr_xdg_shell_create(display);
     struct wlr_cursor *cursor = wlr_cursor_create();
-    struct wlr_xcursor_manager *xcursor_manager = wlr_xcursor_manager_create(NULL, 24);
     struct wlr_seat *seat = wlr_seat_create(display, "seat0");
+    struct wlr_relative_pointer_manager_v1 *relative_pointer =
+        wlr_relative_pointer_manager_v1_create(display);
     wlr_renderer_init_wl_display(renderer, display);
     wlr_cursor_attach_output_layout(cursor, output_layout);
-    wlr_xcursor_manager_load(xcursor_manager, 1);
-    wlr_compositor_create(display, renderer);
+    struct wlr_compositor *compositor = wlr_compositor_create(display, renderer);
     wlr_data_device_manager_create(display);
     *srv = (Server) {
         .display = display,
+        .socket = socket,
+        .startup_time = start,
         .backend = backend,
         .renderer = renderer,
         .output_layout = output_layout,
         .xdg_shell = xdg_shell,
         .cursor = cursor,
-        .xcursor_manager = xcursor_manager,
         .seat = seat,
+        .compositor = compositor,
+        .relative_pointer = relative_pointer,
         .keyboards = {
             .prev = &srv->keyboards,
             .next = &srv->keyboards,
@@ -48,23 +81,56 @@ Server *server_create(void) {
         .on_new_output.notify = server_on_new_output,
         .on_new_xdg_surface.notify = server_on_new_xdg_surface,
         .on_cursor_motion.notify = server_on_cursor_motion,
+        .on_cursor_motion_absolute.notify = server_on_cursor_motion_absolute,
         .on_cursor_button.notify = server_on_cursor_button,
+        .on_cursor_axis.notify = server_on_cursor_axis,
+        .on_cursor_frame.notify = server_on_cursor_frame,
+        .on_request_set_cursor.notify = server_on_request_set_cursor,
+        .on_new_surface.notify = server_on_new_surface,
+        .accounts = {
+            .prev = &srv->accounts,
+            .next = &srv->accounts,
+        },
+        .debug_damage = getenv("BITTER_DEBUG_DAMAGE") != NULL,
+        .render_delay = parse_render_delay(getenv("BITTER_RENDER_DELAY")),
+        .overlay = getenv("BITTER_OVERLAY") != NULL,
+        .adaptive_sync = getenv("BITTER_NO_ADAPTIVE_SYNC") == NULL,
+        .cpu_composite = getenv("BITTER_CPU_COMPOSITE") != NULL,
+        .unfocused_hz = parse_unfocused_hz(getenv("BITTER_UNFOCUSED_HZ")),
     };
     wl_signal_add(&srv->backend->events.new_input, &srv->on_new_input);
     wl_signal_add(&srv->backend->events.new_output, &srv->on_new_output);
     wl_signal_add(&srv->xdg_shell->events.new_surface, &srv->on_new_xdg_surface);
     wl_signal_add(&srv->cursor->events.motion, &srv->on_cursor_motion);
+    wl_signal_add(&srv->cursor->events.motion_absolute,
+        &srv->on_cursor_motion_absolute);
     wl_signal_add(&srv->cursor->events.button, &srv->on_cursor_button);
+    wl_signal_add(&srv->cursor->events.axis, &srv->on_cursor_axis);
+    wl_signal_add(&srv->cursor->events.frame, &srv->on_cursor_frame);
+    wl_signal_add(&srv->seat->events.request_set_cursor,
+        &srv->on_request_set_cursor);
+    wl_signal_add(&srv->compositor->events.new_surface, &srv->on_new_surface);
+    startup_mark_at(srv, "socket", &socket_time);
+    startup_mark_at(srv, "backend", &backend_time);
+    startup_mark(srv, "globals");
+    cursor_theme_init(srv);
+    stats_init(srv);
+    keymap_init(srv);
+    binding_init(srv);
+    transaction_init(srv);
+    capture_init(srv);
+    ipc_init(srv);
+    if (srv->cpu_composite)
+        composite_init(srv);
     return srv;
 }
 
 bool server_run(Server *srv) {
-    const char *socket = wl_display_add_socket_auto(srv->display);
-    if (!socket)
+    if (!srv->socket)
         return false;
     if (!wlr_backend_start(srv->backend))
         return false;
-    setenv("WAYLAND_DISPLAY", socket, true);
+    startup_mark(srv, "backend started");
     wl_display_run(srv->display);
     return true;
 }
@@ -74,12 +140,31 @@ void server_destroy(Server *srv) {
     wl_list_remove(&srv->on_new_output.link);
     wl_list_remove(&srv->on_new_xdg_surface.link);
     wl_list_remove(&srv->on_cursor_motion.link);
+    wl_list_remove(&srv->on_cursor_motion_absolute.link);
     wl_list_remove(&srv->on_cursor_button.link);
-    wlr_xcursor_manager_destroy(srv->xcursor_manager);
+    wl_list_remove(&srv->on_cursor_axis.link);
+    wl_list_remove(&srv->on_cursor_frame.link);
+    wl_list_remove(&srv->on_request_set_cursor.link);
+    wl_list_remove(&srv->on_new_surface.link);
+    // views and then outputs go first, while everything their teardown
+    // touches is still around: relayouts, the transaction timer, the
+    // output layout, IPC events and orphan adoption
+    wl_display_destroy_clients(srv->display);
+    wlr_backend_destroy(srv->backend);
+    if (srv->motion.idle)
+        wl_event_source_remove(srv->motion.idle);
+    if (srv->layout_idle)
+        wl_event_source_remove(srv->layout_idle);
+    ipc_finish(srv);
+    transaction_finish(srv);
+    stats_finish(srv);
+    keymap_finish(srv);
+    cursor_theme_finish(srv);
     wlr_cursor_destroy(srv->cursor);
     wlr_output_layout_destroy(srv->output_layout);
-    wl_display_destroy_clients(srv->display);
     wl_display_destroy(srv->display);
+    wl_array_release(&srv->orphans);
+    pool_finish_all();
     free(srv);
 }
 
@@ -107,33 +192,217 @@ void server_new_input(Server *srv, struct wlr_input_device *device) {
     server_update_capabilities(srv);
 }
 
+static void server_on_layout_idle(void *data) {
+    Server *srv = data;
+    srv->layout_idle = NULL;
+    server_flush_layout(srv);
+}
+
+// Relayouts happen once the event loop runs out of work, so a burst of
+// hotplugs and new windows costs a single pass over what changed.
+static void server_schedule_layout(Server *srv) {
+    if (srv->layout_idle)
+        return;
+    srv->layout_idle = wl_event_loop_add_idle(
+        wl_display_get_event_loop(srv->display), server_on_layout_idle, srv);
+}
+
+void server_reconfigure_output(Server *srv, Output *out) {
+    out->layout_dirty = true;
+    server_schedule_layout(srv);
+}
+
 void server_new_output(Server *srv, struct wlr_output *output) {
+    if (wl_list_empty(&srv->outputs))
+        startup_mark(srv, "output");
     Output *out = output_create(srv, output);
     srv->focused = out->root;
+    server_reconfigure_output(srv, out);
+    // anything left behind by an unplugged output comes back here
+    struct wl_array orphans = srv->orphans;
+    wl_array_init(&srv->orphans);
+    View **view;
+    wl_array_for_each (view, &orphans) {
+        server_adopt_view(srv, *view);
+    }
+    wl_array_release(&orphans);
+}
+
+// Tiles the view next to the focused node, or keeps it aside until there's
+// an output to put it on.
+void server_adopt_view(Server *srv, View *view) {
+    if (!srv->focused && !wl_list_empty(&srv->outputs)) {
+        Output *out = wl_container_of(srv->outputs.next, out, link);
+        srv->focused = out->root;
+    }
+    if (!srv->focused) {
+        View **slot = wl_array_add(&srv->orphans, sizeof(*slot));
+        if (slot)
+            *slot = view;
+        return;
+    }
+    srv->focused = node_insert(srv->focused, view);
+    server_reconfigure_node(srv, srv->focused);
+    ipc_notify(srv, IPC_EVENT(IpcEventFocus));
+}
+
+void server_forget_orphan(Server *srv, View *view) {
+    View **slot;
+    wl_array_for_each (slot, &srv->orphans) {
+        if (*slot == view) {
+            View **last = (View **)((char *)srv->orphans.data
+                + srv->orphans.size) - 1;
+            *slot = *last;
+            srv->orphans.size -= sizeof(*slot);
+            return;
+        }
+    }
+}
+
+void server_new_surface(Server *srv, struct wlr_surface *surface) {
+    upload_tracker_create(srv, surface);
 }
 
 void server_new_xdg_surface(Server *srv, struct wlr_xdg_surface *surface) {
+    if (surface->role == WLR_XDG_SURFACE_ROLE_POPUP) {
+        xdg_popup_create(srv, surface);
+        return;
+    }
     XdgSurface *surf = xdg_surface_create(srv, surface);
     if (surf->surface->role == WLR_XDG_SURFACE_ROLE_TOPLEVEL) {
         view_set_tiled(&surf->base, true);
-        node_insert(srv->focused, (View *)surf);
-        server_reconfigure_outputs(srv);
+        server_adopt_view(srv, &surf->base);
     } else {
-        assert(!"TODO: non-toplevel xdg surfaces");
+        assert(!"TODO: xdg surfaces without a role");
     }
 }
 
+static void server_on_motion_idle(void *data) {
+    Server *srv = data;
+    srv->motion.idle = NULL;
+    server_flush_motion(srv);
+}
+
 void server_cursor_motion(Server *srv, struct wlr_event_pointer_motion *event) {
-    wlr_xcursor_manager_set_cursor_image(
-        srv->xcursor_manager, "left_ptr", srv->cursor);
-    wlr_cursor_move(srv->cursor, event->device, event->delta_x, event->delta_y);
-    // TODO: send the event to the surface under the cursor
+    // clients reading raw motion still get every single event
+    wlr_relative_pointer_manager_v1_send_relative_motion(srv->relative_pointer,
+        srv->seat, (uint64_t)event->time_msec * 1000,
+        event->delta_x, event->delta_y, event->unaccel_dx, event->unaccel_dy);
+
+    if (srv->motion.device && srv->motion.device != event->device)
+        server_flush_motion(srv);
+    srv->motion.device = event->device;
+    srv->motion.dx += event->delta_x;
+    srv->motion.dy += event->delta_y;
+    srv->motion.time_msec = event->time_msec;
+    if (!srv->motion.idle) {
+        srv->motion.idle = wl_event_loop_add_idle(
+            wl_display_get_event_loop(srv->display),
+            server_on_motion_idle, srv);
+    }
+}
+
+void server_cursor_motion_absolute(Server *srv,
+    struct wlr_event_pointer_motion_absolute *event)
+{
+    server_flush_motion(srv);
+    wlr_cursor_warp_absolute(srv->cursor, event->device, event->x, event->y);
+    server_update_pointer(srv, event->time_msec);
 }
 
 void server_cursor_button(Server *srv, struct wlr_event_pointer_button *event) {
+    server_flush_motion(srv);
     wlr_seat_pointer_notify_button(
         srv->seat, event->time_msec, event->button, event->state);
-    // TODO: set pointer focus
+    if (event->state != WLR_BUTTON_PRESSED || !srv->hovered)
+        return;
+    // new windows go next to whatever was clicked last
+    if (srv->hovered->tiled.node) {
+        srv->focused = srv->hovered->tiled.node;
+        ipc_notify(srv, IPC_EVENT(IpcEventFocus));
+    }
+    // the toplevel even when a popup or subsurface was clicked; popups get
+    // the keyboard through their grab
+    struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(srv->seat);
+    if (keyboard) {
+        wlr_seat_keyboard_notify_enter(srv->seat,
+            view_get_surface(srv->hovered), keyboard->keycodes,
+            keyboard->num_keycodes, &keyboard->modifiers);
+    }
+}
+
+void server_cursor_axis(Server *srv, struct wlr_event_pointer_axis *event) {
+    server_flush_motion(srv);
+    wlr_seat_pointer_notify_axis(srv->seat, event->time_msec,
+        event->orientation, event->delta, event->delta_discrete,
+        event->source);
+}
+
+void server_cursor_frame(Server *srv, void *data) {
+    // a frame ends each motion event; hold it until the motion is flushed
+    if (srv->motion.device) {
+        srv->motion.frame = true;
+        return;
+    }
+    wlr_seat_pointer_notify_frame(srv->seat);
+}
+
+void server_request_set_cursor(Server *srv,
+    struct wlr_seat_pointer_request_set_cursor_event *event)
+{
+    if (event->seat_client != srv->seat->pointer_state.focused_client)
+        return;
+    srv->cursor_image = NULL;
+    wlr_cursor_set_surface(srv->cursor, event->surface,
+        event->hotspot_x, event->hotspot_y);
+}
+
+// Applies all motion accumulated so far as a single move.
+void server_flush_motion(Server *srv) {
+    if (!srv->motion.device)
+        return;
+    wlr_cursor_move(srv->cursor, srv->motion.device,
+        srv->motion.dx, srv->motion.dy);
+    bool frame = srv->motion.frame;
+    uint32_t time_msec = srv->motion.time_msec;
+    srv->motion.device = NULL;
+    srv->motion.dx = srv->motion.dy = 0;
+    srv->motion.frame = false;
+    server_update_pointer(srv, time_msec);
+    if (frame)
+        wlr_seat_pointer_notify_frame(srv->seat);
+}
+
+void server_set_cursor_image(Server *srv, const char *name) {
+    if (srv->cursor_image == name)
+        return;
+    srv->cursor_image = name;
+    // still loading; set once the theme is in
+    if (!srv->xcursor_manager)
+        return;
+    wlr_xcursor_manager_set_cursor_image(
+        srv->xcursor_manager, name, srv->cursor);
+}
+
+// Gives pointer focus to whatever surface is under the cursor.
+void server_update_pointer(Server *srv, uint32_t time_msec) {
+    double x = srv->cursor->x, y = srv->cursor->y;
+    struct wlr_output *output =
+        wlr_output_layout_output_at(srv->output_layout, x, y);
+    struct wlr_surface *surface = NULL;
+    double sx, sy;
+    srv->hovered = NULL;
+    if (output) {
+        wlr_output_layout_output_coords(srv->output_layout, output, &x, &y);
+        srv->hovered = output_view_at(output->data, x, y, &surface, &sx, &sy);
+    }
+    if (!surface) {
+        server_set_cursor_image(srv, "left_ptr");
+        wlr_seat_pointer_clear_focus(srv->seat);
+        return;
+    }
+    wlr_seat_pointer_notify_enter(srv->seat, surface, sx, sy);
+    wlr_seat_pointer_notify_motion(srv->seat, time_msec, sx, sy);
 }
 
 void server_update_capabilities(Server *srv) {
@@ -143,9 +412,26 @@ void server_update_capabilities(Server *srv) {
     wlr_seat_set_capabilities(srv->seat, capabilities);
 }
 
-void server_reconfigure_outputs(Server *srv) {
+// Relayouts only the output whose tree the node is in.
+void server_reconfigure_node(Server *srv, Node *n) {
+    while (n->parent)
+        n = n->parent;
+    Output *out;
+    wl_list_for_each (out, &srv->outputs, link) {
+        if (out->root == n) {
+            server_reconfigure_output(srv, out);
+            return;
+        }
+    }
+}
+
+void server_flush_layout(Server *srv) {
     Output *out;
     wl_list_for_each (out, &srv->outputs, link) {
+        if (!out->layout_dirty)
+            continue;
+        out->layout_dirty = false;
         output_configure(out);
     }
+    transaction_commit(srv);
 }
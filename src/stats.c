@@ -0,0 +1,347 @@
+#include "bitter.h"
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <wlr/render/wlr_renderer.h>
+#include <wlr/util/log.h>
+
+// Histogram buckets are log-linear: exact below 16us, then eight buckets
+// per power of two, so every bucket is within 12.5% of the values in it.
+#define HISTOGRAM_LINEAR 16
+#define HISTOGRAM_SUB_BITS 3
+
+static int histogram_bucket(uint32_t value) {
+    if (value < HISTOGRAM_LINEAR)
+        return value;
+    int msb = 31 - __builtin_clz(value);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    int sub = (value >> shift) - (1 << HISTOGRAM_SUB_BITS);
+    return HISTOGRAM_LINEAR + ((msb - 4) << HISTOGRAM_SUB_BITS) + sub;
+}
+
+static uint32_t histogram_bucket_max(int bucket) {
+    if (bucket < HISTOGRAM_LINEAR)
+        return bucket;
+    int msb = ((bucket - HISTOGRAM_LINEAR) >> HISTOGRAM_SUB_BITS) + 4;
+    int sub = ((bucket - HISTOGRAM_LINEAR) & ((1 << HISTOGRAM_SUB_BITS) - 1))
+        + (1 << HISTOGRAM_SUB_BITS);
+    int shift = msb - HISTOGRAM_SUB_BITS;
+    return ((uint32_t)(sub + 1) << shift) - 1;
+}
+
+static void histogram_add(Histogram *h, uint32_t value) {
+    h->counts[histogram_bucket(value)]++;
+    h->total++;
+    if (value > h->max)
+        h->max = value;
+}
+
+// The smallest value that at least the given fraction of samples are at or
+// below, rounded up to its bucket's upper bound.
+uint32_t histogram_percentile(Histogram *h, double fraction) {
+    if (h->total == 0)
+        return 0;
+    uint64_t target = h->total * fraction;
+    if (target == 0)
+        target = 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= target)
+            return histogram_bucket_max(i) < h->max
+                ? histogram_bucket_max(i) : h->max;
+    }
+    return h->max;
+}
+
+int64_t timespec_to_usec(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000 + ts->tv_nsec / 1000;
+}
+
+// Monotonic, like every other timestamp here.
+int64_t now_usec(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return timespec_to_usec(&now);
+}
+
+void stats_record_frame(OutputStats *stats, int render_usec, int surfaces,
+    int drawn, uint64_t upload_bytes)
+{
+    uint64_t uploaded = upload_bytes - stats->upload_seen;
+    stats->upload_seen = upload_bytes;
+    uint32_t head = atomic_load_explicit(&stats->head, memory_order_relaxed);
+    stats->ring[head % STATS_RING_LEN] = (FrameSample) {
+        .render_usec = render_usec,
+        .upload_bytes = uploaded < UINT32_MAX ? uploaded : UINT32_MAX,
+        .surfaces = surfaces,
+        .drawn = drawn,
+    };
+    // readers on other threads see a slot only once it's fully written
+    atomic_store_explicit(&stats->head, head + 1, memory_order_release);
+    histogram_add(&stats->render, render_usec);
+    stats->frames++;
+}
+
+void stats_record_commit(OutputStats *stats, uint32_t commit_seq) {
+    clock_gettime(CLOCK_MONOTONIC, &stats->commit_time);
+    stats->commit_seq = commit_seq;
+}
+
+void stats_record_present(OutputStats *stats,
+    struct wlr_output_event_present *event)
+{
+    if (!event->when || event->commit_seq != stats->commit_seq)
+        return;
+    int64_t latency = timespec_to_usec(event->when)
+        - timespec_to_usec(&stats->commit_time);
+    if (latency < 0)
+        latency = 0;
+    histogram_add(&stats->present, latency);
+    // anything longer than a refresh period means a vblank went by unused
+    if (event->refresh > 0 && latency * 1000 > event->refresh)
+        stats->dropped++;
+}
+
+static void stats_dump_output(Output *out) {
+    OutputStats *stats = &out->stats;
+    uint32_t head = atomic_load_explicit(&stats->head, memory_order_acquire);
+    uint32_t len = head < STATS_RING_LEN ? head : STATS_RING_LEN;
+    uint64_t surfaces = 0, drawn = 0, uploaded = 0;
+    uint32_t upload_max = 0;
+    for (uint32_t i = head - len; i != head; i++) {
+        FrameSample *sample = &stats->ring[i % STATS_RING_LEN];
+        surfaces += sample->surfaces;
+        drawn += sample->drawn;
+        uploaded += sample->upload_bytes;
+        if (sample->upload_bytes > upload_max)
+            upload_max = sample->upload_bytes;
+    }
+    wlr_log(WLR_INFO, "output %s: %llu frames, %llu scanned out, "
+        "%llu dropped", out->output->name, (unsigned long long)stats->frames,
+        (unsigned long long)stats->scanout,
+        (unsigned long long)stats->dropped);
+    wlr_log(WLR_INFO, "  render us: p50 %u p90 %u p99 %u max %u",
+        histogram_percentile(&stats->render, 0.5),
+        histogram_percentile(&stats->render, 0.9),
+        histogram_percentile(&stats->render, 0.99),
+        stats->render.max);
+    wlr_log(WLR_INFO, "  commit to present us: p50 %u p90 %u p99 %u max %u",
+        histogram_percentile(&stats->present, 0.5),
+        histogram_percentile(&stats->present, 0.9),
+        histogram_percentile(&stats->present, 0.99),
+        stats->present.max);
+    if (len > 0) {
+        wlr_log(WLR_INFO, "  surfaces per frame: %.1f on screen, %.1f drawn",
+            (double)surfaces / len, (double)drawn / len);
+        wlr_log(WLR_INFO, "  uploaded per frame: %.1f KiB average, "
+            "%.1f KiB max", uploaded / 1024.0 / len, upload_max / 1024.0);
+    }
+    uint64_t captures = stats->capture.shm + stats->capture.dmabuf;
+    if (captures > 0) {
+        wlr_log(WLR_INFO, "  captures: %llu shm, %.1f MiB read back, "
+            "%llu dmabuf, %.1f us per capture committing",
+            (unsigned long long)stats->capture.shm,
+            stats->capture.bytes / 1048576.0,
+            (unsigned long long)stats->capture.dmabuf,
+            (double)stats->capture.usec / captures);
+    }
+}
+
+void stats_dump(Server *srv) {
+    Output *out;
+    wl_list_for_each (out, &srv->outputs, link) {
+        stats_dump_output(out);
+    }
+    wlr_log(WLR_INFO, "uploaded: %llu KiB total",
+        (unsigned long long)(srv->upload_bytes / 1024));
+    account_dump(srv);
+    startup_dump(srv);
+    pool_dump_all();
+}
+
+static int stats_on_signal(int signal_number, void *data) {
+    stats_dump(data);
+    return 0;
+}
+
+UploadTracker *upload_tracker_create(Server *srv, struct wlr_surface *surface) {
+    UploadTracker *tracker = pool_alloc(&upload_tracker_pool);
+    *tracker = (UploadTracker) {
+        .srv = srv,
+        .surface = surface,
+        .client = wl_resource_get_client(surface->resource),
+        .on_commit.notify = upload_tracker_on_commit,
+        .on_destroy.notify = upload_tracker_on_destroy,
+    };
+    wl_signal_add(&surface->events.commit, &tracker->on_commit);
+    wl_signal_add(&surface->events.destroy, &tracker->on_destroy);
+    account_add(srv, tracker->client, AccountSurface, sizeof(UploadTracker));
+    return tracker;
+}
+
+UploadTracker *upload_tracker_from_surface(struct wlr_surface *surface) {
+    // only this file has the address the listener was added with
+    struct wl_listener *listener = wl_signal_get(&surface->events.destroy,
+        upload_tracker_on_destroy);
+    if (!listener)
+        return NULL;
+    UploadTracker *tracker = wl_container_of(listener, tracker, on_destroy);
+    return tracker;
+}
+
+static void upload_tracker_account_texture(UploadTracker *tracker) {
+    struct wlr_surface *surface = tracker->surface;
+    uint64_t bytes = 0;
+    if (surface->buffer && surface->buffer->texture) {
+        bytes = (uint64_t)surface->current.buffer_width
+            * surface->current.buffer_height * 4;
+    }
+    if (bytes == tracker->texture_bytes)
+        return;
+    if (tracker->texture_bytes > 0) {
+        account_remove(tracker->srv, tracker->client, AccountTexture,
+            tracker->texture_bytes);
+    }
+    if (bytes > 0)
+        account_add(tracker->srv, tracker->client, AccountTexture, bytes);
+    tracker->texture_bytes = bytes;
+}
+
+// wlroots copies only the damaged part of an SHM buffer into the existing
+// texture and releases the buffer right after, unless the size changed and
+// it needs a new texture; count the bytes the same way.
+void upload_tracker_commit(UploadTracker *tracker, void *data) {
+    struct wlr_surface *surface = tracker->surface;
+    upload_tracker_account_texture(tracker);
+    account_commit(tracker->srv, tracker->client);
+    if (tracker->srv->cpu_composite)
+        composite_surface_commit(tracker);
+    if (!surface->buffer || !surface->buffer->resource)
+        return;
+    struct wl_shm_buffer *shm = wl_shm_buffer_get(surface->buffer->resource);
+    if (!shm)
+        return;
+    int width = surface->current.buffer_width;
+    int height = surface->current.buffer_height;
+    if (width <= 0 || height <= 0)
+        return;
+    int bytes_per_pixel = wl_shm_buffer_get_stride(shm) / width;
+    uint64_t pixels = 0;
+    if (width != tracker->buffer_width || height != tracker->buffer_height) {
+        pixels = (uint64_t)width * height;
+        tracker->buffer_width = width;
+        tracker->buffer_height = height;
+    } else {
+        pixman_region32_t damage;
+        pixman_region32_init(&damage);
+        pixman_region32_intersect_rect(&damage, &surface->buffer_damage,
+            0, 0, width, height);
+        int nrects;
+        pixman_box32_t *rects = pixman_region32_rectangles(&damage, &nrects);
+        for (int i = 0; i < nrects; i++) {
+            pixels += (uint64_t)(rects[i].x2 - rects[i].x1)
+                * (rects[i].y2 - rects[i].y1);
+        }
+        pixman_region32_fini(&damage);
+    }
+    tracker->srv->upload_bytes += pixels * bytes_per_pixel;
+}
+
+void upload_tracker_destroy(UploadTracker *tracker, void *data) {
+    composite_surface_finish(tracker);
+    if (tracker->texture_bytes > 0) {
+        account_remove(tracker->srv, tracker->client, AccountTexture,
+            tracker->texture_bytes);
+    }
+    account_remove(tracker->srv, tracker->client, AccountSurface,
+        sizeof(UploadTracker));
+    wl_list_remove(&tracker->on_commit.link);
+    wl_list_remove(&tracker->on_destroy.link);
+    pool_free(&upload_tracker_pool, tracker);
+}
+
+void startup_mark_at(Server *srv, const char *name, struct timespec *when) {
+    if (srv->started || srv->startup_len == STARTUP_MARKS)
+        return;
+    srv->startup[srv->startup_len++] = (StartupMark) {
+        .name = name,
+        .usec = timespec_to_usec(when) - timespec_to_usec(&srv->startup_time),
+    };
+}
+
+void startup_mark(Server *srv, const char *name) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    startup_mark_at(srv, name, &now);
+}
+
+void startup_dump(Server *srv) {
+    for (int i = 0; i < srv->startup_len; i++) {
+        wlr_log(WLR_INFO, "startup: %s at %.1f ms", srv->startup[i].name,
+            srv->startup[i].usec / 1000.0);
+    }
+}
+
+// Closes the startup timeline once the first frame has been committed.
+void startup_first_frame(Server *srv) {
+    if (srv->started)
+        return;
+    startup_mark(srv, "first frame");
+    srv->started = true;
+    startup_dump(srv);
+}
+
+void stats_init(Server *srv) {
+    srv->stats_signal = wl_event_loop_add_signal(
+        wl_display_get_event_loop(srv->display), SIGUSR1,
+        stats_on_signal, srv);
+}
+
+void stats_finish(Server *srv) {
+    wl_event_source_remove(srv->stats_signal);
+}
+
+void stats_overlay_box(Output *out, struct wlr_box *box) {
+    *box = (struct wlr_box) {
+        .x = 0,
+        .y = 0,
+        .width = STATS_OVERLAY_SAMPLES * 2,
+        .height = STATS_OVERLAY_HEIGHT,
+    };
+}
+
+// Bars for recent render times, scaled so the top of the graph is one
+// refresh period; frames that took longer than that are drawn red.
+void stats_render_overlay(Output *out) {
+    struct wlr_renderer *renderer = out->srv->renderer;
+    float *projection = out->output->transform_matrix;
+    struct wlr_box box;
+    stats_overlay_box(out, &box);
+    wlr_render_rect(renderer, &box, (float[4]){0.0f, 0.0f, 0.0f, 0.6f},
+        projection);
+
+    int refresh = out->output->refresh > 0 ? out->output->refresh : 60000;
+    int period = 1000000000 / refresh;
+    OutputStats *stats = &out->stats;
+    uint32_t head = atomic_load_explicit(&stats->head, memory_order_acquire);
+    uint32_t len = head < STATS_OVERLAY_SAMPLES ? head : STATS_OVERLAY_SAMPLES;
+    for (uint32_t i = 0; i < len; i++) {
+        FrameSample *sample = &stats->ring[(head - len + i) % STATS_RING_LEN];
+        int height = (int64_t)sample->render_usec * box.height / period;
+        bool late = height > box.height;
+        if (late)
+            height = box.height;
+        if (height < 1)
+            height = 1;
+        struct wlr_box bar = {
+            .x = box.x + i * 2,
+            .y = box.y + box.height - height,
+            .width = 2,
+            .height = height,
+        };
+        wlr_render_rect(renderer, &bar, late
+            ? (float[4]){0.8f, 0.1f, 0.1f, 1.0f}
+            : (float[4]){0.1f, 0.8f, 0.1f, 1.0f}, projection);
+    }
+}
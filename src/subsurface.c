@@ -0,0 +1,52 @@
+#include "bitter.h"
+
+Subsurface *subsurface_create(Server *srv, struct wlr_subsurface *subsurface) {
+    Subsurface *sub = pool_alloc(&subsurface_pool);
+    *sub = (Subsurface) {
+        .srv = srv,
+        .subsurface = subsurface,
+        .on_commit.notify = subsurface_on_commit,
+        .on_new_subsurface.notify = subsurface_on_new_subsurface,
+        .on_destroy.notify = subsurface_on_destroy,
+    };
+    wl_signal_add(&subsurface->surface->events.commit, &sub->on_commit);
+    wl_signal_add(&subsurface->surface->events.new_subsurface,
+        &sub->on_new_subsurface);
+    wl_signal_add(&subsurface->events.destroy, &sub->on_destroy);
+    subsurface_create_children(srv, subsurface->surface);
+    return sub;
+}
+
+// For subsurfaces the client made before we started listening to their
+// parent.
+void subsurface_create_children(Server *srv, struct wlr_surface *surface) {
+    struct wlr_subsurface *subsurface;
+    wl_list_for_each (subsurface, &surface->subsurfaces, parent_link)
+        subsurface_create(srv, subsurface);
+}
+
+void subsurface_commit(Subsurface *sub, void *data) {
+    XdgSurface *surf = xdg_surface_from_wlr_surface(sub->subsurface->surface);
+    if (!surf)
+        return;
+    view_damage(&surf->base, false);
+    view_update_bounds(&surf->base);
+}
+
+void subsurface_new_subsurface(Subsurface *sub, void *data) {
+    subsurface_create(sub->srv, data);
+}
+
+void subsurface_destroy(Subsurface *sub, void *data) {
+    XdgSurface *surf = xdg_surface_from_wlr_surface(sub->subsurface->surface);
+    if (surf) {
+        view_damage(&surf->base, true);
+        surf->base.scene.dirty = true;
+        if (surf->base.out)
+            surf->base.out->grid.dirty = true;
+    }
+    wl_list_remove(&sub->on_commit.link);
+    wl_list_remove(&sub->on_new_subsurface.link);
+    wl_list_remove(&sub->on_destroy.link);
+    pool_free(&subsurface_pool, sub);
+}
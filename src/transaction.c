@@ -0,0 +1,135 @@
+#include "bitter.h"
+#include <wlr/util/log.h>
+
+// A relayout doesn't move anything on screen right away. Each view that
+// changes keeps its current box until every client that was asked to resize
+// has acked and committed, and then all of them move in the same frame.
+// Outputs showing any of them don't render in the meantime, so the old
+// layout stays up instead of a mix of old and new sizes. A client that
+// doesn't answer holds them for at most TRANSACTION_TIMEOUT_MSEC.
+
+static bool view_pending_equal(View *view, Output *out, struct wlr_box *box) {
+    Output *cur_out = view->txn.pending ? view->txn.out : view->out;
+    struct wlr_box *cur_box = view->txn.pending ? &view->txn.box : &view->box;
+    return cur_out == out && cur_box->x == box->x && cur_box->y == box->y
+        && cur_box->width == box->width && cur_box->height == box->height;
+}
+
+void transaction_add_view(View *view, Output *out, struct wlr_box *box) {
+    Server *srv = view->srv;
+    if (view_pending_equal(view, out, box))
+        return;
+    if (!view->txn.pending) {
+        view->txn.pending = true;
+        wl_list_insert(&srv->txn.views, &view->txn.link);
+    }
+    view->txn.out = out;
+    view->txn.box = *box;
+    // moves don't need the client's cooperation
+    if (box->width == view->width && box->height == view->height)
+        return;
+    view->width = box->width;
+    view->height = box->height;
+    uint32_t serial = view_set_size(view, box->width, box->height);
+    if (serial != 0 && view->txn.serial == 0)
+        srv->txn.waiting++;
+    else if (serial == 0 && view->txn.serial != 0)
+        srv->txn.waiting--;
+    view->txn.serial = serial;
+}
+
+static void view_apply(View *view) {
+    view_damage(view, true);
+    if (view->out) {
+        view->out->grid.dirty = true;
+        view->out->scene.dirty = true;
+    }
+    view->out = view->txn.out;
+    view->box = view->txn.box;
+    view_update_bounds(view);
+    view->out->grid.dirty = true;
+    view->out->scene.dirty = true;
+    view_damage(view, true);
+}
+
+void transaction_apply(Server *srv) {
+    if (srv->txn.waiting > 0) {
+        wlr_log(WLR_DEBUG, "applying layout with %d views not ready",
+            srv->txn.waiting);
+    }
+    View *view, *tmp;
+    wl_list_for_each_safe (view, tmp, &srv->txn.views, txn.link) {
+        wl_list_remove(&view->txn.link);
+        view->txn.pending = false;
+        view->txn.serial = 0;
+        view_apply(view);
+    }
+    srv->txn.waiting = 0;
+    srv->txn.timer_armed = false;
+    wl_event_source_timer_update(srv->txn.timer, 0);
+    ipc_notify(srv, IPC_EVENT(IpcEventLayout));
+}
+
+static int transaction_on_timeout(void *data) {
+    transaction_apply(data);
+    return 0;
+}
+
+void transaction_init(Server *srv) {
+    wl_list_init(&srv->txn.views);
+    srv->txn.timer = wl_event_loop_add_timer(
+        wl_display_get_event_loop(srv->display), transaction_on_timeout, srv);
+}
+
+void transaction_finish(Server *srv) {
+    wl_event_source_remove(srv->txn.timer);
+}
+
+// Called once a relayout has queued all its changes.
+void transaction_commit(Server *srv) {
+    if (wl_list_empty(&srv->txn.views))
+        return;
+    if (srv->txn.waiting == 0) {
+        transaction_apply(srv);
+        return;
+    }
+    // a newer relayout doesn't push the deadline back
+    if (!srv->txn.timer_armed) {
+        srv->txn.timer_armed = true;
+        wl_event_source_timer_update(srv->txn.timer, TRANSACTION_TIMEOUT_MSEC);
+    }
+}
+
+// Called when a client commits after acking the given configure serial.
+void transaction_view_ready(View *view, uint32_t acked_serial) {
+    Server *srv = view->srv;
+    if (view->txn.serial == 0 || acked_serial < view->txn.serial)
+        return;
+    view->txn.serial = 0;
+    if (--srv->txn.waiting == 0)
+        transaction_apply(srv);
+}
+
+// Drops a view that is going away from the pending transaction; the caller
+// relayouts afterwards, which applies it if nothing else is waiting.
+void transaction_remove_view(View *view) {
+    if (!view->txn.pending)
+        return;
+    wl_list_remove(&view->txn.link);
+    view->txn.pending = false;
+    if (view->txn.serial != 0)
+        view->srv->txn.waiting--;
+    view->txn.serial = 0;
+}
+
+// Whether the output would show a half-applied layout if it rendered now.
+bool transaction_blocks_output(Server *srv, Output *out) {
+    if (srv->txn.waiting == 0)
+        return false;
+    View *view;
+    wl_list_for_each (view, &srv->txn.views, txn.link) {
+        if (view->out == out || view->txn.out == out)
+            return true;
+    }
+    return false;
+}
@@ -13,3 +13,108 @@ void view_for_each_surface(View *view, wlr_surface_iterator_func_t iter,
 {
     view->impl->for_each_surface(view, iter, data);
 }
+
+void view_get_origin(View *view, int *x, int *y) {
+    view->impl->get_origin(view, x, y);
+}
+
+struct wlr_surface *view_get_surface(View *view) {
+    return view->impl->get_surface(view);
+}
+
+struct wlr_surface *view_surface_at(View *view, double x, double y,
+    double *sx, double *sy)
+{
+    return view->impl->surface_at(view, x, y, sx, sy);
+}
+
+void view_close(View *view) {
+    view->impl->close(view);
+}
+
+typedef struct ViewDamageData ViewDamageData;
+struct ViewDamageData {
+    View *view;
+    int x, y;
+    bool whole;
+};
+
+static void damage_surface(struct wlr_surface *surface, int sx, int sy,
+    void *data)
+{
+    ViewDamageData *ddata = data;
+    output_damage_surface(ddata->view->out, surface,
+        ddata->x + sx, ddata->y + sy, ddata->whole);
+}
+
+void view_damage(View *view, bool whole) {
+    if (!view->out)
+        return;
+    ViewDamageData ddata = {
+        .view = view,
+        .whole = whole,
+    };
+    view_get_origin(view, &ddata.x, &ddata.y);
+    view_for_each_surface(view, damage_surface, &ddata);
+}
+
+typedef struct ViewBoundsData ViewBoundsData;
+struct ViewBoundsData {
+    int x, y;
+    pixman_box32_t extents;
+    bool empty;
+};
+
+static void bounds_surface(struct wlr_surface *surface, int sx, int sy,
+    void *data)
+{
+    ViewBoundsData *bdata = data;
+    pixman_box32_t box = {
+        .x1 = bdata->x + sx,
+        .y1 = bdata->y + sy,
+        .x2 = bdata->x + sx + surface->current.width,
+        .y2 = bdata->y + sy + surface->current.height,
+    };
+    if (box.x1 == box.x2 || box.y1 == box.y2)
+        return;
+    if (bdata->empty) {
+        bdata->extents = box;
+        bdata->empty = false;
+        return;
+    }
+    if (box.x1 < bdata->extents.x1)
+        bdata->extents.x1 = box.x1;
+    if (box.y1 < bdata->extents.y1)
+        bdata->extents.y1 = box.y1;
+    if (box.x2 > bdata->extents.x2)
+        bdata->extents.x2 = box.x2;
+    if (box.y2 > bdata->extents.y2)
+        bdata->extents.y2 = box.y2;
+}
+
+// Recomputes the view's bounds, and flags its output's grid for a rebuild
+// if they changed.
+// Called when the view moves, and on commits to its own surface, its popups
+// and any of their subsurfaces.
+void view_update_bounds(View *view) {
+    if (!view->out)
+        return;
+    view->scene.dirty = true;
+    ViewBoundsData bdata = {
+        .empty = true,
+    };
+    view_get_origin(view, &bdata.x, &bdata.y);
+    view_for_each_surface(view, bounds_surface, &bdata);
+    struct wlr_box bounds = {
+        .x = bdata.extents.x1,
+        .y = bdata.extents.y1,
+        .width = bdata.extents.x2 - bdata.extents.x1,
+        .height = bdata.extents.y2 - bdata.extents.y1,
+    };
+    if (bounds.x == view->bounds.x && bounds.y == view->bounds.y
+        && bounds.width == view->bounds.width
+        && bounds.height == view->bounds.height)
+        return;
+    view->bounds = bounds;
+    view->out->grid.dirty = true;
+}
@@ -6,20 +6,32 @@
 static ViewImpl xdg_surface_impl;
 
 XdgSurface *xdg_surface_create(Server *srv, struct wlr_xdg_surface *surface) {
-    XdgSurface *surf = malloc(sizeof(XdgSurface));
+    XdgSurface *surf = pool_alloc(&xdg_surface_pool);
     *surf = (XdgSurface) {
         .base = (View) {
             .srv = srv,
             .kind = ViewXdgSurface,
+            .id = ++srv->next_view_id,
             .impl = &xdg_surface_impl,
         },
         .surface = surface,
+        .on_commit.notify = xdg_surface_on_commit,
+        .on_new_subsurface.notify = xdg_surface_on_new_subsurface,
         .on_destroy.notify = xdg_surface_on_destroy,
     };
+    surface->data = surf;
+    wl_signal_add(&surf->surface->surface->events.commit, &surf->on_commit);
+    wl_signal_add(&surf->surface->surface->events.new_subsurface,
+        &surf->on_new_subsurface);
     wl_signal_add(&surf->surface->events.destroy, &surf->on_destroy);
+    subsurface_create_children(srv, surface->surface);
+    account_add(srv, wl_resource_get_client(surface->resource),
+        AccountView, sizeof(XdgSurface) + sizeof(Node));
     struct wlr_keyboard *keyboard = wlr_seat_get_keyboard(srv->seat);
-    wlr_seat_keyboard_notify_enter(srv->seat, surface->surface, keyboard->keycodes,
-        keyboard->num_keycodes, &keyboard->modifiers);
+    if (keyboard) {
+        wlr_seat_keyboard_notify_enter(srv->seat, surface->surface, keyboard->keycodes,
+            keyboard->num_keycodes, &keyboard->modifiers);
+    }
     return surf;
 }
 
@@ -28,9 +40,111 @@ XdgSurface *xdg_surface_from_view(View *view) {
     return (XdgSurface *)view;
 }
 
+void xdg_surface_commit(XdgSurface *surf, void *data) {
+    view_damage(&surf->base, false);
+    view_update_bounds(&surf->base);
+    transaction_view_ready(&surf->base, surf->surface->configure_serial);
+}
+
+void xdg_surface_new_subsurface(XdgSurface *surf, void *data) {
+    subsurface_create(surf->base.srv, data);
+}
+
 void xdg_surface_destroy(XdgSurface *surf, void *data) {
-    wl_list_remove(&surf->base.tiled.link);
-    free(surf);
+    Server *srv = surf->base.srv;
+    account_remove(srv, wl_resource_get_client(surf->surface->resource),
+        AccountView, sizeof(XdgSurface) + sizeof(Node));
+    view_damage(&surf->base, true);
+    wl_list_remove(&surf->on_commit.link);
+    wl_list_remove(&surf->on_new_subsurface.link);
+    wl_list_remove(&surf->on_destroy.link);
+    surf->surface->data = NULL;
+    transaction_remove_view(&surf->base);
+    scene_view_finish(&surf->base);
+    if (srv->hovered == &surf->base)
+        srv->hovered = NULL;
+    if (!surf->base.tiled.node) {
+        server_forget_orphan(srv, &surf->base);
+        pool_free(&xdg_surface_pool, surf);
+        return;
+    }
+    bool focused = srv->focused == surf->base.tiled.node;
+    Node *next = node_remove(&surf->base);
+    if (focused)
+        srv->focused = next;
+    server_reconfigure_node(srv, next);
+    pool_free(&xdg_surface_pool, surf);
+}
+
+// The view a surface is drawn as part of, going up through subsurface and
+// popup parents, or NULL if it's already gone or there isn't one.
+XdgSurface *xdg_surface_from_wlr_surface(struct wlr_surface *surface) {
+    while (surface) {
+        if (wlr_surface_is_subsurface(surface)) {
+            surface = wlr_subsurface_from_wlr_surface(surface)->parent;
+            continue;
+        }
+        if (!wlr_surface_is_xdg_surface(surface))
+            return NULL;
+        struct wlr_xdg_surface *xdg = wlr_xdg_surface_from_wlr_surface(surface);
+        if (xdg->role != WLR_XDG_SURFACE_ROLE_POPUP)
+            return xdg->data;
+        surface = xdg->popup->parent;
+    }
+    return NULL;
+}
+
+static View *xdg_popup_view(XdgPopup *popup) {
+    XdgSurface *surf = xdg_surface_from_wlr_surface(popup->surface->surface);
+    return surf ? &surf->base : NULL;
+}
+
+XdgPopup *xdg_popup_create(Server *srv, struct wlr_xdg_surface *surface) {
+    XdgPopup *popup = pool_alloc(&xdg_popup_pool);
+    *popup = (XdgPopup) {
+        .srv = srv,
+        .surface = surface,
+        .on_commit.notify = xdg_popup_on_commit,
+        .on_new_subsurface.notify = xdg_popup_on_new_subsurface,
+        .on_destroy.notify = xdg_popup_on_destroy,
+    };
+    wl_signal_add(&surface->surface->events.commit, &popup->on_commit);
+    wl_signal_add(&surface->surface->events.new_subsurface,
+        &popup->on_new_subsurface);
+    wl_signal_add(&surface->events.destroy, &popup->on_destroy);
+    subsurface_create_children(srv, surface->surface);
+    account_add(srv, wl_resource_get_client(surface->resource),
+        AccountPopup, sizeof(XdgPopup));
+    return popup;
+}
+
+void xdg_popup_commit(XdgPopup *popup, void *data) {
+    View *view = xdg_popup_view(popup);
+    if (!view)
+        return;
+    view_damage(view, false);
+    view_update_bounds(view);
+}
+
+void xdg_popup_new_subsurface(XdgPopup *popup, void *data) {
+    subsurface_create(popup->srv, data);
+}
+
+void xdg_popup_destroy(XdgPopup *popup, void *data) {
+    account_remove(popup->srv,
+        wl_resource_get_client(popup->surface->resource),
+        AccountPopup, sizeof(XdgPopup));
+    View *view = xdg_popup_view(popup);
+    if (view) {
+        view_damage(view, true);
+        view->scene.dirty = true;
+        if (view->out)
+            view->out->grid.dirty = true;
+    }
+    wl_list_remove(&popup->on_commit.link);
+    wl_list_remove(&popup->on_new_subsurface.link);
+    wl_list_remove(&popup->on_destroy.link);
+    pool_free(&xdg_popup_pool, popup);
 }
 
 static uint32_t set_size_impl(View *view, int width, int height) {
@@ -50,8 +164,39 @@ static void for_each_surface_impl(View *view,
         xdg_surface_from_view(view)->surface, iter, data);
 }
 
+static int int_min(int a, int b) {
+    return a < b ? a : b;
+}
+
+static void get_origin_impl(View *view, int *x, int *y) {
+    struct wlr_xdg_surface *surface = xdg_surface_from_view(view)->surface;
+    // TODO: this seems like a hack, but it makes alacritty's csd work in tiling.
+    // hopefully it actually works everywhere.
+    *x = view->box.x - int_min(0, surface->geometry.x);
+    *y = view->box.y - int_min(0, surface->geometry.y);
+}
+
+static struct wlr_surface *get_surface_impl(View *view) {
+    return xdg_surface_from_view(view)->surface->surface;
+}
+
+static struct wlr_surface *surface_at_impl(View *view, double x, double y,
+    double *sx, double *sy)
+{
+    return wlr_xdg_surface_surface_at(
+        xdg_surface_from_view(view)->surface, x, y, sx, sy);
+}
+
+static void close_impl(View *view) {
+    wlr_xdg_toplevel_send_close(xdg_surface_from_view(view)->surface);
+}
+
 static ViewImpl xdg_surface_impl = {
     .set_size = set_size_impl,
     .set_tiled = set_tiled_impl,
     .for_each_surface = for_each_surface_impl,
+    .get_origin = get_origin_impl,
+    .get_surface = get_surface_impl,
+    .surface_at = surface_at_impl,
+    .close = close_impl,
 };